@@ -0,0 +1,162 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include "Kernels.h"
+using namespace std;
+
+/* Microbenchmark for the dot-product kernels in Kernels.h.
+   For every SIMD level this CPU supports and every kernel, one query is scored against a block of rows until
+   at least 0.2 s have passed, and the rate is reported as GFLOP/s (2 * DIM flops per dot product: one multiply
+   and one add per value). Two row counts are run: "hot" fits in L2, so it measures the arithmetic, and
+   "stream" is far larger than the caches, so it measures how fast each storage format can be pulled from memory.
+   The blocked one-to-many and many-to-many kernels are timed the same way, a whole block per call.
+   Every result is also checked against the scalar kernel.
+   Usage: kernel_bench [seconds per measurement]
+*/
+
+double seconds_per_run = 0.2;
+
+// Scores q against every row until seconds_per_run has passed; returns dot products per second
+template <typename F>
+double measure(size_t rows, F&& score_row, double& checksum) {
+  size_t dots = 0;
+  double sum = 0;
+  auto t1 = chrono::steady_clock::now();
+  double elapsed = 0;
+  while (elapsed < seconds_per_run) {
+    for (size_t r = 0; r < rows; r++) {
+      sum += score_row(r);
+    }
+    dots += rows;
+    elapsed = chrono::duration<double>(chrono::steady_clock::now() - t1).count();
+  }
+  checksum = sum / (dots / rows);
+  return dots / elapsed;
+}
+
+template <size_t DIM>
+void benchDim(size_t rows, const string& label) {
+  mt19937 rng(1);
+  normal_distribution<float> g(0.0f, 1.0f);
+  vector<float> q(DIM);
+  vector<float> scale(DIM, 1.0f / 127);
+  vector<int8_t> q8(DIM);
+  for (size_t i = 0; i < DIM; i++) {
+    q[i] = g(rng) / sqrt((float)DIM);
+    q8[i] = (int8_t)(g(rng) * 30);
+  }
+  vector<float> f32(rows * DIM);
+  vector<uint16_t> f16(rows * DIM), bf16(rows * DIM);
+  vector<int8_t> i8(rows * DIM);
+  for (size_t i = 0; i < rows * DIM; i++) {
+    f32[i] = g(rng) / sqrt((float)DIM);
+    f16[i] = kernels::f32_to_f16(f32[i]);
+    bf16[i] = kernels::f32_to_bf16(f32[i]);
+    i8[i] = (int8_t)max(-127.0f, min(127.0f, f32[i] * 127 * 4));
+  }
+
+  struct Kernel {
+    string name;
+    function<double(size_t)> run;
+  };
+  vector<Kernel> ks = {
+    {"f32", [&](size_t r) {return kernels::dot_f32<DIM>(q.data(), f32.data() + r * DIM);}},
+    {"f16", [&](size_t r) {return kernels::dot_f16<DIM>(q.data(), f16.data() + r * DIM);}},
+    {"bf16", [&](size_t r) {return kernels::dot_bf16<DIM>(q.data(), bf16.data() + r * DIM);}},
+    {"i8 (f32 q)", [&](size_t r) {return kernels::dot_i8f<DIM>(q.data(), i8.data() + r * DIM);}},
+    {"i8 (dim scales)", [&](size_t r) {return kernels::dot_i8f_scaled<DIM>(q.data(), scale.data(), i8.data() + r * DIM);}},
+    {"i8 x i8", [&](size_t r) {return (double)kernels::dot_i8<DIM>(q8.data(), i8.data() + r * DIM);}},
+  };
+
+  cout << "DIM = " << DIM << ", " << label << " (" << rows << " rows)" << endl;
+  cout << "  " << left << setw(17) << "kernel";
+  for (int l = 0; l <= (int)kernels::detected_level; l++) {
+    cout << right << setw(11) << kernels::simdLevelName((kernels::SimdLevel)l);
+  }
+  cout << "   max rel. diff vs scalar" << endl;
+  for (auto& k : ks) {
+    cout << "  " << left << setw(17) << k.name;
+    double reference = 0, worst = 0;
+    for (int l = 0; l <= (int)kernels::detected_level; l++) {
+      kernels::setSimdLevel((kernels::SimdLevel)l);
+      double checksum = 0;
+      double rate = measure(rows, k.run, checksum);
+      if (l == 0) {
+        reference = checksum;
+      }
+      else {
+        worst = max(worst, fabs(checksum - reference) / max(1e-12, fabs(reference)));
+      }
+      cout << right << setw(11) << fixed << setprecision(2) << rate * 2 * DIM / 1e9;
+    }
+    cout << "   " << scientific << setprecision(1) << worst << defaultfloat << endl;
+  }
+
+  // Blocked kernels: the whole block per call, so the query (or batch of queries) stays in registers
+  vector<float> out(rows * kernels::QBLOCK);
+  vector<float> qb(kernels::QBLOCK * DIM);
+  for (float& v : qb) {
+    v = g(rng) / sqrt((float)DIM);
+  }
+  const float *qs[kernels::QBLOCK];
+  for (size_t j = 0; j < kernels::QBLOCK; j++) {
+    qs[j] = qb.data() + j * DIM;
+  }
+  auto row = [&](size_t r) {return f32.data() + r * DIM;};
+  struct Blocked {
+    string name;
+    size_t queries;
+    function<void()> run;
+  };
+  vector<Blocked> bs = {
+    {"f32 1-to-many", 1, [&]() {kernels::dot_many_f32<DIM>(q.data(), row, rows, out.data());}},
+    {"f32 4-to-many", kernels::QBLOCK, [&]() {kernels::dot_batch_f32<DIM>(qs, kernels::QBLOCK, row, rows, out.data());}},
+  };
+  for (auto& b : bs) {
+    cout << "  " << left << setw(17) << b.name;
+    double reference = 0, worst = 0;
+    for (int l = 0; l <= (int)kernels::detected_level; l++) {
+      kernels::setSimdLevel((kernels::SimdLevel)l);
+      size_t calls = 0;
+      auto t1 = chrono::steady_clock::now();
+      double elapsed = 0;
+      while (elapsed < seconds_per_run) {
+        b.run();
+        calls++;
+        elapsed = chrono::duration<double>(chrono::steady_clock::now() - t1).count();
+      }
+      double checksum = 0;
+      for (size_t i = 0; i < rows * b.queries; i++) {
+        checksum += out[i];
+      }
+      if (l == 0) {
+        reference = checksum;
+      }
+      else {
+        worst = max(worst, fabs(checksum - reference) / max(1e-12, fabs(reference)));
+      }
+      cout << right << setw(11) << fixed << setprecision(2) << calls * rows * b.queries * 2.0 * DIM / elapsed / 1e9;
+    }
+    cout << "   " << scientific << setprecision(1) << worst << defaultfloat << endl;
+  }
+  kernels::setSimdLevel(kernels::detected_level);
+  cout << "  (GFLOP/s)" << endl;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    seconds_per_run = stod(argv[1]);
+  }
+  cout << "Detected SIMD level: " << kernels::simdLevelName(kernels::detected_level) << endl;
+  benchDim<100>(1024, "hot");
+  benchDim<300>(1024, "hot");
+  benchDim<100>(1 << 20, "stream");
+  benchDim<300>(1 << 18, "stream");
+  return 0;
+}
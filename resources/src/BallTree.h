@@ -1,296 +1,1097 @@
 #ifndef BALLTREE_H
 #define BALLTREE_H
 #include <iostream>
+#include <fstream>
+#include <cstring>
 #include "Words.h"
+#include "MappedFile.h"
+#include "Metrics.h"
 #include <vector>
 #include <cmath>
-#include <queue>
+#include <array>
+#include <algorithm>
+#include <limits>
+#include <atomic>
+#include <memory>
+#include <random>
+#include "Parallel.h"
 using namespace std;
 
-// Object for comparing distances and WordVectors.
-struct knn_Node {
-  float distance;
-  WordVector word;
+const size_t BALL_TREE_FORK_MIN = 4096; // Subtrees at least this big are built as separate pool tasks
+const size_t BALL_TREE_CHUNK = 16384; // Rows per chunk of the data-parallel passes over a node's points
+const int BALL_TREE_KMEANS_ROUNDS = 4; // Update-and-reassign rounds of a 2-means split
+const int BALL_TREE_POWER_ROUNDS = 8; // Power-iteration rounds for the principal direction of a PCA split
+const int BALL_TREE_FIT_ROUNDS = 8; // Rounds that move a ball's center toward the minimum enclosing ball (fitBall)
+const size_t BALL_TREE_SAMPLE = 1024; // Default sample size of a sampled build (setSampling)
+const uint64_t BALL_TREE_SAMPLE_SEED = 0x5eed; // Default seed of a sampled build
 
-  knn_Node(float d, WordVector& w) : distance(d), word(w) {}
+// How constructBalltreeHelper divides a ball's points between its two children.
+enum class BallSplit {
+  Pivots,   // Each point goes to the nearer of two far-apart pivots (the original rule)
+  TwoMeans, // BALL_TREE_KMEANS_ROUNDS rounds of 2-means seeded with the pivots (spherical for cosine)
+  PCAMedian // Median of the projections on the principal direction, so both halves are the same size
+};
+
+inline string splitName(BallSplit s) {
+  switch (s) {
+    case BallSplit::TwoMeans: return "2means";
+    case BallSplit::PCAMedian: return "pca";
+    default: return "pivots";
+  }
+}
 
-  bool operator< (const knn_Node &other) const {
-    return distance < other.distance;
+// Parses "pivots" / "2means" / "pca". Returns false for anything else.
+inline bool parseSplit(const string& name, BallSplit& out) {
+  for (BallSplit s : {BallSplit::Pivots, BallSplit::TwoMeans, BallSplit::PCAMedian}) {
+    if (name == splitName(s)) {
+      out = s;
+      return true;
+    }
+  }
+  return false;
+}
+
+// The k nearest (id, distance) pairs found so far, kept in memory the caller owns: a binary max-heap on distance,
+// so the worst kept pair is items[0] and offer never allocates. Heap operations referenced from
+// https://en.cppreference.com/w/cpp/algorithm/push_heap
+struct KnnHeap {
+  pair<int,float> *items;
+  size_t capacity;
+  size_t count = 0;
+
+  KnnHeap(pair<int,float> *items, size_t capacity) : items(items), capacity(capacity) {}
+  static bool closer(const pair<int,float>& a, const pair<int,float>& b) {return a.second < b.second;}
+  // Distance a new pair has to beat to be kept (infinity until the heap is full).
+  float worst() const {return count < capacity ? numeric_limits<float>::infinity() : items[0].second;}
+  void offer(int id, float distance) {
+    if (count < capacity) {
+      items[count++] = {id, distance};
+      push_heap(items, items + count, closer);
+    }
+    else if (capacity > 0 && distance < items[0].second) {
+      pop_heap(items, items + count, closer);
+      items[count - 1] = {id, distance};
+      push_heap(items, items + count, closer);
+    }
   }
+  // Sorts the kept pairs nearest first; the items are no longer a heap afterwards.
+  void sortNearestFirst() {sort_heap(items, items + count, closer);}
 };
 
+// Distance evaluations made by BallTree searches: ball centers tested and rows scored (rows that early abandoning
+// gave up on count as one each).
+struct BallSearchStats {
+  uint64_t queries = 0;
+  uint64_t centers = 0;
+  uint64_t points = 0;
+  double perQuery() const {return queries > 0 ? (double)(centers + points) / queries : 0;}
+};
+
+// Shape of a built tree, to compare split rules.
+struct BallTreeShape {
+  size_t leaves = 0;
+  size_t max_depth = 0; // Edges from the root to the deepest leaf
+  double mean_row_depth = 0; // Depth of the leaf holding a row, averaged over rows
+  vector<size_t> leaf_sizes; // leaf_sizes[b]: leaves with 2^b <= size < 2^(b+1) rows
+};
+
+// Node of the tree while it is being built. constructBalltree freezes the finished tree into FlatBallNode.
+template <size_t DIM>
 struct BallTreeNode {
   BallTreeNode *left; // Left ball
   BallTreeNode *right; // Right ball
-  float radius; // Radius of ball
-  vector<float> center; // Center point - some vector containing a string and 100 dimension values
-  vector<WordVector> words; // If this node is a leaf, it will have a vector of points contained within the sphere.
+  float radius; // Radius of ball, as Metric::ballRadius stores it (an angle for cosine)
+  array<float, DIM> center; // Center point - some vector containing DIM dimension values
+  float center_extra = 0; // Augmented coordinate of the center (inner-product metric only)
+  float center_norm2 = 1; // |center|^2, including center_extra
+  // The points contained within the sphere are the ids order[begin, end) of the tree's id permutation
+  // (BallTree::order). Construction partitions that array in place, so leaves copy no ids.
+  size_t begin = 0, end = 0;
 
   // Main Methods
   BallTreeNode() : left(nullptr), right(nullptr), radius(0.0) {} // Constructor
-  void setWords(vector<WordVector> words) {this->words = words;}
+  void setRange(size_t begin, size_t end) {this->begin = begin; this->end = end;}
+  size_t size() const {return end - begin;}
   float getRadius() {return radius;}
 };
 
+const uint32_t NO_CHILD = numeric_limits<uint32_t>::max();
+
+// Node of the frozen tree that knn_search runs on. Nodes are kept in one array in depth-first (pre)order, so a
+// node's left child is usually the next node and the top of the tree shares a few cache lines. The center of
+// node i is row i of BallTree::centers, and the points of a leaf are rows [begin, end) of BallTree::leaf_rows.
+// 32 bytes, two nodes per cache line. Children are indices, not pointers, so the array is written to and mapped
+// from an index file as it is (BallTree::saveIndex).
+struct alignas(32) FlatBallNode {
+  uint32_t left = NO_CHILD, right = NO_CHILD; // Child indices, NO_CHILD for none
+  uint32_t begin = 0, end = 0; // Points: ids order[begin, end)
+  float radius = 0; // Metric::ballRadius of the farthest point
+  float center_extra = 0; // Augmented coordinate of the center (inner-product metric only)
+  float center_norm2 = 1; // |center|^2, including center_extra
+  uint32_t reserved = 0; // Padding, zero so saved files are reproducible
+  bool isLeaf() const {return left == NO_CHILD && right == NO_CHILD;}
+};
+static_assert(sizeof(FlatBallNode) == 32, "FlatBallNode is stored as it is in index files");
+
+/* Binary file of a frozen ball tree, so a restart maps the tree instead of building it again:
+    [BallTreeFileHeader][pad to 64][FlatBallNode, node_count][pad to 64][float centers, node_count x dim]
+    [pad to 64][int32 ids, rows][pad to 64][float leaf rows, rows x dim]   (only if BALL_TREE_FILE_LEAF_ROWS)
+   Every section is 64-byte aligned and addressed by its offset, and nodes refer to each other and to the ids by
+   index, so the file is used in place from the mapping. checksum is Words::checksum of the rows the tree was
+   built on; a file is only loaded over the same rows (same snapshot, basis and storage) and for the same build
+   settings (split, sample_size and sample_seed, leaf rows). Every node and id is checked before the tree is used.
+*/
+struct BallTreeFileHeader {
+  char magic[8];            // "WVBALLT\0"
+  uint32_t version;
+  uint32_t byte_order;      // 0x01020304 as written
+  uint64_t checksum;        // Words::checksum of the indexed rows
+  uint64_t rows;
+  uint64_t node_count;
+  uint32_t dim;
+  uint32_t flags;           // Bit 0: the file has the leaf rows section
+  char metric[16];          // Metric::name
+  uint32_t split;           // BallSplit the tree was built with
+  uint32_t reserved;
+  uint64_t nodes_offset;
+  uint64_t centers_offset;
+  uint64_t ids_offset;
+  uint64_t leaf_rows_offset; // 0 without leaf rows
+  uint64_t sample_size;     // BallTree::setSampling the tree was built with
+  uint64_t sample_seed;
+};
+
+const char BALL_TREE_FILE_MAGIC[8] = {'W', 'V', 'B', 'A', 'L', 'L', 'T', 0};
+const uint32_t BALL_TREE_FILE_VERSION = 2;
+const uint32_t BALL_TREE_FILE_LEAF_ROWS = 1;
+
+// Metric is one of the policies in Metrics.h; the default is cosine on the normalized rows.
+template <size_t DIM, typename Metric = CosineMetric>
 class BallTree {
   private:
-    BallTreeNode *root;
-    int max_leaf_size = 20; // Can be changed. Currently being not used
+    using BallTreeNode = ::BallTreeNode<DIM>;
+    using Vec = array<float, DIM>;
+
+    BallTreeNode *root = nullptr; // Only while constructBalltree runs
+    // The frozen tree that searches read. The arrays point into the owned buffers below after constructBalltree,
+    // or straight into the mapped file after loadIndex.
+    const FlatBallNode *nodes = nullptr; // node_total nodes, root first (see FlatBallNode)
+    size_t node_total = 0;
+    const float *centers = nullptr; // node_total x DIM, center of node i at row i
+    const int *row_ids = nullptr; // row_total ids: order, as construction left it
+    size_t row_total = 0;
+    const float *leaf_rows = nullptr; // fp32 row of row_ids[i] at row i, so a leaf is one contiguous block (setLeafRows)
+    // Backing storage for a built tree
+    vector<FlatBallNode> owned_nodes;
+    AlignedFloats owned_centers;
+    AlignedFloats owned_leaf_rows;
+    // Backing storage for a loaded tree
+    MappedFile mapping;
+    // Balls with at most this many points become leaves, so it sets the leaf ranges of the frozen nodes and of
+    // the leaf-row copy.
+    size_t max_leaf_size = 20;
+    static constexpr size_t LEAF_BLOCK = 64; // Rows scored per dotMany call in a leaf scan
+    const Words<DIM> *all_words = nullptr; // Rows are read through Words::dot/decode, so any storage format works
+    int rerank_depth = 0; // Candidates to rescore with exact fp32 rows when storage is approximate (0 = off)
+    RowNorms<DIM, Metric> norms; // Row norms / augmented coordinates for the L2 and inner-product metrics
+    vector<int> order; // Every row id once, permuted during construction so each node's points are contiguous
+    vector<char> goes_left; // goes_left[i]: order[i] goes to the left child (construction only)
+    vector<float> split_keys; // Projection of each row id on its ball's principal direction (PCA splits only)
+    BallSplit split = BallSplit::TwoMeans;
+    bool copy_leaf_rows = true;
+    size_t sample_size = 0; // Pivots and centers of bigger nodes come from this many sampled rows (0 = all rows)
+    uint64_t sample_seed = BALL_TREE_SAMPLE_SEED;
+    atomic<size_t> node_count{0};
+    WorkStealingPool *pool = nullptr; // Set while constructBalltree runs on more than one thread
+    // Totals for getSearchStats; each search adds its counts once.
+    mutable atomic<uint64_t> stat_queries{0}, stat_centers{0}, stat_points{0};
+
+    // Calls f(chunk, chunk_begin, chunk_end) for the BALL_TREE_CHUNK-row chunks of [begin, end), on the pool when
+    // there is more than one. Callers combine per-chunk results in chunk order, so the result does not depend on
+    // the thread count.
+    size_t chunkCount(size_t begin, size_t end) const {return (end - begin + BALL_TREE_CHUNK - 1) / BALL_TREE_CHUNK;}
+    template <typename F>
+    void forChunks(size_t begin, size_t end, F&& f) {
+      const size_t chunks = chunkCount(begin, end);
+      auto run = [&](size_t c) {f(c, begin + c * BALL_TREE_CHUNK, min(end, begin + (c + 1) * BALL_TREE_CHUNK));};
+      if (pool != nullptr && chunks > 1) {
+        pool->parallelFor(chunks, run);
+      }
+      else {
+        for (size_t c = 0; c < chunks; c++) {
+          run(c);
+        }
+      }
+    }
+
+    // Metric distance between the point (v, v_extra) with squared norm v_norm2 and row id.
+    float pointDistance(const float *v, float v_extra, float v_norm2, size_t id) const {
+      return Metric::distance(all_words->dot(v, id) + v_extra * norms.extra(id), v_norm2, norms.squaredNorm(id));
+    }
+    // Metric distance between the query q (squared norm qq) and the center of node B.
+    float centerDistance(const float *q, float qq, uint32_t B) const {
+      return Metric::distance(kernels::dot_f32<DIM>(q, centers + (size_t)B * DIM), qq, nodes[B].center_norm2);
+    }
+    // Copies the subtree of B into nodes / centers in depth-first order and deletes B. Returns B's index.
+    uint32_t freeze(BallTreeNode *B);
+    // The ids a node's pivots and centers are computed from (see constructBalltreeHelper): order[begin, end) itself,
+    // or sample_size of them drawn with a generator seeded by sample_seed and the range, into sample.
+    size_t sampleIds(size_t begin, size_t end, vector<int>& sample, const int *&ids) const;
+    // Sets the center of B to the mean of ids[0, n) (normalized for cosine), moved toward the minimum enclosing
+    // ball of order[begin, end), and its radius to cover every id in order[begin, end).
+    void fitBall(BallTreeNode *B, size_t begin, size_t end, const int *ids, size_t n);
+    // Step (4) of constructBalltreeHelper: divides order[begin, end) into L = order[begin, mid) and
+    // R = order[mid, end) by the split rule and returns mid. A and B are the far-apart pivots of step (2); the
+    // 2-means and PCA directions are fitted to ids[0, n).
+    size_t splitPoints(size_t begin, size_t end, int A, int B, const int *ids, size_t n);
+    size_t splitPCAMedian(size_t begin, size_t end, const Vec& a, const Vec& b, const int *ids, size_t n);
+    // Partitions order[begin, end) in place so the positions with goes_left set come first; returns the boundary.
+    size_t partitionBySide(size_t begin, size_t end);
+    // Mean c of the rows ids[i], i in [0, n), with sides[i] == side (normalized for cosine), with its augmented
+    // coordinate and squared norm. Returns false if no row is on that side.
+    bool sideMean(const int *ids, const char *sides, size_t n, char side, Vec& c, float& c_extra, float& c_norm2);
   public:
     // Helper Functions:
-    // Computes the lowest cosine similarity (ie closest to -1) comparing an input word to other vectors.
-    WordVector lowestCosSimilarity(const WordVector input_word, const vector<WordVector> word_list);
+    // Returns the id among ids[0, n) farthest from row input_id by the metric (for cosine, the lowest cosine
+    // similarity, ie closest to -1). Returns input_id if every point is at distance 0 from it.
+    int lowestCosSimilarity(int input_id, const int *ids, size_t n);
 
     // Normalizes an input vector
-    vector<float> normalize(vector<float>& input);
+    Vec normalize(Vec& input);
 
-    // Returns the average vector of a vector of WordVectors
-    vector<float> average(const vector<WordVector>& input_words);
+    // Returns the average vector of the rows ids[0, n)
+    Vec average(const int *ids, size_t n);
 
-    // Computes the cosine similarity of two vectors
-    float cosine_similarity(const vector<float>& a, const vector<float>& b);
+    // Computes the cosine similarity of two DIM-dimensional vectors
+    float cosine_similarity(const float *a, const float *b);
 
     // Computes the cosine distance of two vectors (1 - cosine_similarity(a, b))
-    float cosine_distance(const vector<float>& a, const vector<float>& b);
+    float cosine_distance(const float *a, const float *b);
 
-    // Main ball tree constructor:
-    BallTreeNode* constructBalltreeHelper(const vector<WordVector>& words, Words& all_words);
+    // Main ball tree constructor, over the ids order[begin, end). The two subtrees of a node with at least
+    // BALL_TREE_FORK_MIN points are built in parallel when there is a pool.
+    BallTreeNode* constructBalltreeHelper(size_t begin, size_t end, const Words<DIM>& all_words);
 
-    // KNN search algorithm:
-    void knn_search_helper(const WordVector t, int k, priority_queue<knn_Node>& Q, BallTreeNode* B);
+    // KNN search algorithm (t is the query vector, DIM floats, with squared norm tt; B_distance is the distance
+    // from t to the center of B; aq is t prepared for early abandoning, or nullptr to score leaves with the blocked
+    // kernel; q8 is t quantized for int8 storage, or nullptr; stats counts the distances computed):
+    void knn_search_helper(const float *t, float tt, KnnHeap& Q, uint32_t B, float B_distance, const AbandonQuery<DIM> *aq,
+                           const QuantizedQuery<DIM> *q8, BallSearchStats& stats) const;
 
     // Getters:
-    BallTreeNode *getRoot() {return root;}
+    // Index of the root in the frozen node array (NO_CHILD for an empty tree).
+    uint32_t getRoot() const {return node_total == 0 ? NO_CHILD : 0;}
+    // Bytes held by the frozen nodes, their centers, the leaf rows and the id permutation (mapped or not).
+    size_t memoryBytes() const {
+      return node_total * (sizeof(FlatBallNode) + DIM * sizeof(float))
+             + (leaf_rows ? row_total * DIM * sizeof(float) : 0) + row_total * sizeof(int);
+    }
+    bool isMapped() const {return mapping.isOpen();}
+    BallSplit getSplit() const {return split;}
+
+    BallTreeShape shape() const;
+    BallSearchStats getSearchStats() const {return {stat_queries.load(), stat_centers.load(), stat_points.load()};}
+    void resetSearchStats() const {stat_queries = 0; stat_centers = 0; stat_points = 0;}
+
+    // Setters:
+    // With quantized storage, search depth candidates and rerank them exactly (ignored unless depth > k).
+    void setRerankDepth(int depth) {rerank_depth = depth;}
+    // Split rule for the next constructBalltree.
+    void setSplit(BallSplit s) {split = s;}
+    // Whether the next constructBalltree copies the fp32 rows into leaf order, so each leaf is scanned as one
+    // contiguous block instead of rows gathered from the matrix by id (on by default). The copy is as big as the
+    // fp32 matrix and is only made with fp32 storage and no early abandoning.
+    void setLeafRows(bool on) {copy_leaf_rows = on;}
+    // Sampled build for the next constructBalltree: nodes with more than size points choose their pivots, center
+    // and split direction from size of them (drawn with seed), so only the radius and the partition read every
+    // point. size 0 reads every point for everything (the default).
+    void setSampling(size_t size, uint64_t seed = BALL_TREE_SAMPLE_SEED) {sample_size = size; sample_seed = seed;}
 
     // Main Methods:
-    void constructBalltree(const vector<WordVector>& words, Words& all_words);
-    priority_queue<knn_Node> knn_search(const WordVector t, int k);
+    // Builds the tree on threads threads. The tree is the same for every thread count.
+    void constructBalltree(const Words<DIM>& all_words, unsigned threads = defaultThreadCount());
+    // Writes the frozen tree as an index file (see BallTreeFileHeader). Returns false on I/O errors.
+    bool saveIndex(string fileName) const;
+    // Maps an index file written by saveIndex for the rows of all_words, in place of constructBalltree. Returns
+    // false, printing why, if the file is not a tree of this metric and dimension, was built on other rows or with
+    // other settings than the ones set for the next constructBalltree (setSplit, setSampling, setLeafRows), or is
+    // corrupt.
+    bool loadIndex(string fileName, const Words<DIM>& all_words);
+    // Writes the k nearest rows to the vector q (DIM floats, which need not be a word of the tree) into out, as
+    // (id, similarity) pairs nearest first, and returns how many it wrote (k, unless the tree has fewer rows).
+    // out needs room for k pairs. The similarity is Metric::similarity, the cosine for cosine. Nothing is printed
+    // and nothing is allocated, except by the fp32 rerank of quantized storage (setRerankDepth).
+    size_t search(const float *q, size_t k, pair<int,float> *out) const;
 };
 
-WordVector BallTree::lowestCosSimilarity(const WordVector input_word, const vector<WordVector> word_list_vector) {
-  WordVector most_semantically_dissimilar;
-  float lowest_cos_similarity = 1;
-  for (int i = 0; i < word_list_vector.size(); i++) {
-    float cos_sim = cosine_similarity(input_word.vec, word_list_vector[i].vec);
-    if (cos_sim < lowest_cos_similarity) {
-      most_semantically_dissimilar = word_list_vector[i];
-      lowest_cos_similarity = cos_sim;
+template <size_t DIM, typename Metric>
+int BallTree<DIM, Metric>::lowestCosSimilarity(int input_id, const int *ids, size_t n) {
+  int most_semantically_dissimilar = input_id;
+  float greatest_distance = 0; // Cosine similarity 1
+  Vec input;
+  all_words->decode(input_id, input.data());
+  const float input_extra = norms.extra(input_id);
+  const float input_norm2 = norms.squaredNorm(input_id);
+  // Farthest point of each chunk; ties keep the earliest, in the chunks and across them, as a serial scan would.
+  vector<pair<float,int>> farthest(chunkCount(0, n), {greatest_distance, input_id});
+  forChunks(0, n, [&](size_t c, size_t first, size_t last) {
+    for (size_t i = first; i < last; i++) {
+      float distance = pointDistance(input.data(), input_extra, input_norm2, ids[i]);
+      if (distance > farthest[c].first) {
+        farthest[c] = {distance, ids[i]};
+      }
+    }
+  });
+  for (const pair<float,int>& f : farthest) {
+    if (f.first > greatest_distance) {
+      most_semantically_dissimilar = f.second;
+      greatest_distance = f.first;
     }
   }
   return most_semantically_dissimilar;
 }
 
-vector<float> BallTree::normalize(vector<float>& input) {
+template <size_t DIM, typename Metric>
+typename BallTree<DIM, Metric>::Vec BallTree<DIM, Metric>::normalize(Vec& input) {
   float sum = 0;
-  for (int i = 0; i < input.size(); i++) {
+  for (size_t i = 0; i < input.size(); i++) {
     float num = input[i] * input[i];
     sum += num;
   }
   sum = sqrt(sum);
-  for (int j = 0; j < input.size(); j++) {
+  for (size_t j = 0; j < input.size(); j++) {
     input[j] = input[j] / sum;
   }
   return input;
 }
 
-vector<float> BallTree::average(const vector<WordVector>& input_words) {
-  vector<float> output(100);
-  for (int i = 0; i < input_words.size(); i++) {
-    for (int j = 0; j < input_words[i].vec.size(); j++) {
-      output[j] += input_words[i].vec[j];
+template <size_t DIM, typename Metric>
+typename BallTree<DIM, Metric>::Vec BallTree<DIM, Metric>::average(const int *ids, size_t n) {
+  Vec output{};
+  vector<Vec> sums(chunkCount(0, n), Vec{});
+  forChunks(0, n, [&](size_t c, size_t first, size_t last) {
+    Vec row;
+    for (size_t i = first; i < last; i++) {
+      all_words->decode(ids[i], row.data());
+      for (size_t j = 0; j < DIM; j++) {
+        sums[c][j] += row[j];
+      }
+    }
+  });
+  for (const Vec& sum : sums) {
+    for (size_t j = 0; j < DIM; j++) {
+      output[j] += sum[j];
     }
   }
-  for (int k = 0; k < output.size(); k++) {
-    output[k] = output[k] / input_words.size();
+  for (size_t k = 0; k < output.size(); k++) {
+    output[k] = output[k] / n;
   }
   return output;
 }
 
-float BallTree::cosine_similarity(const vector<float>& a, const vector<float>& b) {
-  float sum = 0;
-  for (int i = 0; i < a.size(); i++) {
-    sum += (a[i] * b[i]);
+template <size_t DIM, typename Metric>
+void BallTree<DIM, Metric>::fitBall(BallTreeNode *B, size_t begin, size_t end, const int *ids, size_t n) {
+  Vec p = average(ids, n);
+  float p_extra = 0;
+  if constexpr (Metric::normalized) {
+    normalize(p);
   }
-  return sum;
+  if constexpr (Metric::augmented) {
+    for (size_t i = 0; i < n; i++) {
+      p_extra += norms.extra(ids[i]);
+    }
+    p_extra /= n;
+  }
+  // Distance from (v, v_extra) to its farthest point in order[begin, end), and that point. Per-chunk maxima are
+  // combined in chunk order, so ties go to the same point on any number of threads.
+  auto farthest = [&](const Vec& v, float v_extra, float v_norm2, int& far_id) {
+    vector<float> max_distance(chunkCount(begin, end), -1.0f);
+    vector<int> max_id(max_distance.size(), order[begin]);
+    forChunks(begin, end, [&](size_t c, size_t first, size_t last) {
+      for (size_t i = first; i < last; i++) {
+        float distance = pointDistance(v.data(), v_extra, v_norm2, order[i]); // Cosine distance for cosine
+        if (distance > max_distance[c]) {
+          max_distance[c] = distance;
+          max_id[c] = order[i];
+        }
+      }
+    });
+    size_t c = max_element(max_distance.begin(), max_distance.end()) - max_distance.begin();
+    far_id = max_id[c];
+    return max(0.0f, max_distance[c]);
+  };
+  auto squaredNorm = [](const Vec& v, float v_extra) {
+    return Metric::normalized ? 1 : kernels::dot_f32<DIM>(v.data(), v.data()) + v_extra * v_extra;
+  };
+  float p_norm2 = squaredNorm(p, p_extra);
+  int far_id;
+  float max_distance = farthest(p, p_extra, p_norm2, far_id);
+  // Move the center toward the minimum enclosing ball: step 1/(k + 2) of the way to the current farthest point
+  // and keep the center with the smallest radius. Badoiu-Clarkson iteration, referenced from
+  // https://en.wikipedia.org/wiki/Bounding_sphere#Core-set_based_approximation
+  Vec c = p, x;
+  float c_extra = p_extra;
+  for (int k = 0; k < BALL_TREE_FIT_ROUNDS && max_distance > 0; k++) {
+    all_words->decode(far_id, x.data());
+    const float step = 1.0f / (k + 2);
+    for (size_t j = 0; j < DIM; j++) {
+      c[j] += (x[j] - c[j]) * step;
+    }
+    c_extra += (norms.extra(far_id) - c_extra) * step;
+    if constexpr (Metric::normalized) {
+      normalize(c);
+    }
+    const float c_norm2 = squaredNorm(c, c_extra);
+    const float distance = farthest(c, c_extra, c_norm2, far_id);
+    if (distance < max_distance) {
+      max_distance = distance;
+      p = c;
+      p_extra = c_extra;
+      p_norm2 = c_norm2;
+    }
+  }
+  B->radius = Metric::ballRadius(max_distance);
+  B->center = p;
+  B->center_extra = p_extra;
+  B->center_norm2 = p_norm2;
+}
+
+template <size_t DIM, typename Metric>
+float BallTree<DIM, Metric>::cosine_similarity(const float *a, const float *b) {
+  return kernels::dot_f32<DIM>(a, b); // Unit vectors, so the dot product is the cosine (SIMD, see Kernels.h)
 }
 
 /* Psuedocode source: https://en.wikipedia.org/wiki/Ball_tree
-    Translated to cosine similarity/distance (project context):
+    Translated to cosine similarity/distance (project context). With the L2 and inner-product metrics, "cosine
+    distance" below reads as the metric's distance (see Metrics.h) and the center is not normalized.
     1. Instantiate new root node
     2. Calculate the spread. For cosine similarity, its 2 points with the greatest angular distance.
        (Logic for spread calculation obtained from 18:55 in https://www.youtube.com/watch?v=E1_WCdUAtyE)
     3. "let p be the central point selected considering c"
-        In this case, p is the normalized average of all vectors in words.
+        In this case, p is the normalized average of all rows in order[begin, end).
         Use cosine distance for a "radius" measure. Source I used to learn about cosine distance: https://medium.com/@milana.shxanukova15/cosine-distance-and-cosine-similarity-a5da0e4d9ded
     4. "let L, R be the sets of points [with a with cosine similarities closest to A or B, respectively] along [spread A,B]"
+       The node's points are the ids order[begin, end); they are partitioned in place, so L is order[begin, mid)
+       and R is order[mid, end) and no ids or word views are copied. That is BallSplit::Pivots; setSplit can
+       refine the pivots by 2-means, or split at the median along the principal direction instead (splitPoints).
     5. "B.pivot := p" == root.center := p (pivot)
-    6. Check if L or R are empty to prevent infinite recursion. IMPORTANT: Since this is a leaf, the words must be set.
+    6. Check if L or R are empty to prevent infinite recursion. IMPORTANT: Since this is a leaf, its range must be set.
     7. Create B with two children:
        "B.child1 := construct_balltree(L)" (root->left)
        "B.child2 := construct_balltree(R)" (root->right)
+       With a pool, big nodes build L as a forked task while this thread builds R, and the O(n) passes of (2),
+       (3) and (4) run in chunks on the pool (forChunks).
+   With setSampling, a node with more than sample_size points takes its pivots (2), its center (3) and the
+   2-means / PCA fit of (4) from a random sample of sample_size of them (sampleIds). Only the radius and the
+   final assignment of (4) still read every point, so a node costs O(n) distances, not the several passes of
+   the exact build, and skewed splits that keep big nodes around for many levels stay cheap. The radius is
+   exact either way, so searches stay exact; the balls are only placed less well. The sample is seeded by the
+   node's range, which does not depend on the thread count, so neither does the tree.
 */
-BallTreeNode* BallTree::constructBalltreeHelper(const vector<WordVector>& words, Words& all_words) {
-  if (words.size() == 0) {
+template <size_t DIM, typename Metric>
+BallTreeNode<DIM>* BallTree<DIM, Metric>::constructBalltreeHelper(size_t begin, size_t end, const Words<DIM>& all_words) {
+  if (begin == end) {
     return nullptr;
   }
-  if (words.size() <= max_leaf_size) {
+  node_count++;
+  if (end - begin <= max_leaf_size) {
     BallTreeNode *root = new BallTreeNode();
-    root->setWords(words);
+    root->setRange(begin, end);
 
     // Compute the center vector and radius of leaf nodes for knn_search.
-    vector<float> p = average(words);
-    normalize(p);
-    float max_cos_distance = 0;
-    for (int i = 0; i < words.size(); i++) {
-      float num = cosine_similarity(p, words[i].vec);
-      if (1-num > max_cos_distance) {
-        max_cos_distance = 1-num; // Cosine distance
-      }
-    }
-    root->radius = max_cos_distance;
-    root->center = p;
+    fitBall(root, begin, end, order.data() + begin, end - begin);
 
     return root;
   }
   else {
     // (1)
     BallTreeNode *root = new BallTreeNode();
+    root->setRange(begin, end);
+    vector<int> sample;
+    const int *ids;
+    const size_t n = sampleIds(begin, end, sample, ids);
     // (2)
-    WordVector A = lowestCosSimilarity(words[0], words);
-    WordVector B = lowestCosSimilarity(A, words);
-    // (3)
-    vector<float> p = average(words);
-    normalize(p);
-    float max_cos_distance = 0;
-    for (int i = 0; i < words.size(); i++) {
-      float num = cosine_similarity(p, words[i].vec);
-      if (1-num > max_cos_distance) {
-        max_cos_distance = 1-num; // Cosine distance
-      }
-    }
-    root->radius = max_cos_distance;
+    const int A = lowestCosSimilarity(ids[0], ids, n);
+    const int B = lowestCosSimilarity(A, ids, n);
+    // (3) and (5)
+    fitBall(root, begin, end, ids, n);
     // (4)
-    vector<WordVector> L;
-    vector<WordVector> R;
-    for (int i = 0; i < words.size(); i++) {
-      if (cosine_similarity(A.vec, words[i].vec) > cosine_similarity(B.vec, words[i].vec)) {
-        L.push_back(words[i]);
-      }
-      else {
-        R.push_back(words[i]);
-      }
-    }
-    // (5)
-    root->center = p;
+    const size_t mid = splitPoints(begin, end, A, B, ids, n);
     // (6)
-    // cout << "Splitting " << words.size() << " words..." << endl; // remove later
-    if (words.size() > 100000) {
+    if (end - begin > 100000) {
       cout << "." << flush;
     }
-    if (L.empty() || R.empty()) {
-      root->setWords(words);
+    if (mid == begin || mid == end) {
       return root;
     }
     // (7)
-    root->left = constructBalltreeHelper(L, all_words);
-    root->right = constructBalltreeHelper(R, all_words);
+    if (pool != nullptr && end - begin >= BALL_TREE_FORK_MIN) {
+      WorkStealingPool::TaskGroup left;
+      pool->fork(left, [&]() {root->left = constructBalltreeHelper(begin, mid, all_words);});
+      root->right = constructBalltreeHelper(mid, end, all_words);
+      pool->join(left);
+    }
+    else {
+      root->left = constructBalltreeHelper(begin, mid, all_words);
+      root->right = constructBalltreeHelper(mid, end, all_words);
+    }
     return root;
   }
 }
 
-void BallTree::constructBalltree(const vector<WordVector>& words, Words& all_words) {
-  root = constructBalltreeHelper(words, all_words);
+template <size_t DIM, typename Metric>
+size_t BallTree<DIM, Metric>::sampleIds(size_t begin, size_t end, vector<int>& sample, const int *&ids) const {
+  const size_t n = end - begin;
+  ids = order.data() + begin;
+  if (sample_size == 0 || n <= sample_size) {
+    return n;
+  }
+  // Drawn with replacement; a repeated id only weighs a little more in the means.
+  mt19937_64 random(sample_seed ^ (begin * 0x9E3779B97F4A7C15ull) ^ (end * 0xC2B2AE3D27D4EB4Full));
+  sample.resize(sample_size);
+  for (int& id : sample) {
+    id = order[begin + random() % n];
+  }
+  ids = sample.data();
+  return sample_size;
+}
+
+template <size_t DIM, typename Metric>
+size_t BallTree<DIM, Metric>::splitPoints(size_t begin, size_t end, int A, int B, const int *ids, size_t n) {
+  Vec a, b;
+  all_words->decode(A, a.data());
+  all_words->decode(B, b.data());
+  if (split == BallSplit::PCAMedian) {
+    return splitPCAMedian(begin, end, a, b, ids, n);
+  }
+  float a_extra = norms.extra(A), a_norm2 = norms.squaredNorm(A);
+  float b_extra = norms.extra(B), b_norm2 = norms.squaredNorm(B);
+  // The distances are computed in parallel chunks, then order[begin, end) is partitioned in place by swapping
+  // from both ends, which is cheap next to the distances and gives the same order on any number of threads.
+  auto assign = [&](const int *ids, char *sides, size_t n) {
+    forChunks(0, n, [&](size_t, size_t first, size_t last) {
+      for (size_t i = first; i < last; i++) {
+        sides[i] = pointDistance(a.data(), a_extra, a_norm2, ids[i]) < pointDistance(b.data(), b_extra, b_norm2, ids[i]);
+      }
+    });
+  };
+  // 2-means, referenced from https://en.wikipedia.org/wiki/K-means_clustering ("Standard algorithm"): move each
+  // pivot to the mean of the points assigned to it, then reassign. For cosine the means are normalized, which is
+  // spherical k-means ("Concept Decompositions for Large Sparse Text Data Using Clustering", Dhillon and Modha,
+  // Machine Learning 2001). A sampled node runs the rounds on its sample and assigns every point once at the end.
+  const bool sampled = ids != order.data() + begin;
+  vector<char> sample_sides(sampled ? n : 0);
+  char *sides = sampled ? sample_sides.data() : goes_left.data() + begin;
+  if (split == BallSplit::TwoMeans) {
+    assign(ids, sides, n);
+    for (int round = 0; round < BALL_TREE_KMEANS_ROUNDS; round++) {
+      if (!sideMean(ids, sides, n, 1, a, a_extra, a_norm2) || !sideMean(ids, sides, n, 0, b, b_extra, b_norm2)) {
+        break;
+      }
+      assign(ids, sides, n);
+    }
+  }
+  if (sampled || split != BallSplit::TwoMeans) {
+    assign(order.data() + begin, goes_left.data() + begin, end - begin);
+  }
+  return partitionBySide(begin, end);
 }
 
-float BallTree::cosine_distance(const vector<float>& a, const vector<float>& b) {
+/* Median split along the principal direction:
+    1. Power iteration, referenced from https://en.wikipedia.org/wiki/Power_iteration: starting from the pivot
+       direction a - b, repeat v := sum_i ((x_i - m) . v) (x_i - m), normalized, where m is the mean. This converges
+       to the top eigenvector of the points' covariance without forming the DIM x DIM matrix. The x_i are ids[0, n),
+       the node's sample on a sampled build.
+    2. Project every point on v and put the lower half on the left (nth_element), so both children get half the
+       points whatever the shape of the data.
+*/
+template <size_t DIM, typename Metric>
+size_t BallTree<DIM, Metric>::splitPCAMedian(size_t begin, size_t end, const Vec& a, const Vec& b, const int *ids, size_t n) {
+  // (1)
+  const Vec m = average(ids, n);
+  Vec v;
+  for (size_t j = 0; j < DIM; j++) {
+    v[j] = a[j] - b[j];
+  }
+  for (int round = 0; round <= BALL_TREE_POWER_ROUNDS; round++) {
+    const float length = sqrt(kernels::dot_f32<DIM>(v.data(), v.data()));
+    if (!(length > 0)) {
+      return begin; // Every point is the same: leave them in one leaf
+    }
+    for (size_t j = 0; j < DIM; j++) {
+      v[j] /= length;
+    }
+    if (round == BALL_TREE_POWER_ROUNDS) {
+      break;
+    }
+    const float mv = kernels::dot_f32<DIM>(m.data(), v.data());
+    vector<Vec> sums(chunkCount(0, n), Vec{});
+    forChunks(0, n, [&](size_t c, size_t first, size_t last) {
+      Vec x;
+      for (size_t i = first; i < last; i++) {
+        all_words->decode(ids[i], x.data());
+        const float s = kernels::dot_f32<DIM>(x.data(), v.data()) - mv;
+        for (size_t j = 0; j < DIM; j++) {
+          sums[c][j] += s * (x[j] - m[j]);
+        }
+      }
+    });
+    v = Vec{};
+    for (const Vec& sum : sums) {
+      for (size_t j = 0; j < DIM; j++) {
+        v[j] += sum[j];
+      }
+    }
+  }
+  // (2)
+  forChunks(begin, end, [&](size_t, size_t first, size_t last) {
+    for (size_t i = first; i < last; i++) {
+      split_keys[order[i]] = all_words->dot(v.data(), order[i]);
+    }
+  });
+  const size_t mid = begin + (end - begin) / 2;
+  nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+              [&](int x, int y) {return split_keys[x] < split_keys[y];});
+  return mid;
+}
+
+template <size_t DIM, typename Metric>
+size_t BallTree<DIM, Metric>::partitionBySide(size_t begin, size_t end) {
+  size_t mid = begin, right = end;
+  while (true) {
+    while (mid < right && goes_left[mid]) {
+      mid++;
+    }
+    while (mid < right && !goes_left[right - 1]) {
+      right--;
+    }
+    if (mid == right) {
+      return mid;
+    }
+    swap(order[mid++], order[--right]);
+  }
+}
+
+template <size_t DIM, typename Metric>
+bool BallTree<DIM, Metric>::sideMean(const int *ids, const char *sides, size_t n, char side, Vec& c, float& c_extra, float& c_norm2) {
+  struct Sum {
+    Vec v{};
+    float extra = 0;
+    size_t count = 0;
+  };
+  vector<Sum> sums(chunkCount(0, n));
+  forChunks(0, n, [&](size_t k, size_t first, size_t last) {
+    Vec row;
+    for (size_t i = first; i < last; i++) {
+      if (sides[i] != side) {
+        continue;
+      }
+      all_words->decode(ids[i], row.data());
+      for (size_t j = 0; j < DIM; j++) {
+        sums[k].v[j] += row[j];
+      }
+      sums[k].extra += norms.extra(ids[i]);
+      sums[k].count++;
+    }
+  });
+  Sum total;
+  for (const Sum& sum : sums) {
+    for (size_t j = 0; j < DIM; j++) {
+      total.v[j] += sum.v[j];
+    }
+    total.extra += sum.extra;
+    total.count += sum.count;
+  }
+  if (total.count == 0) {
+    return false;
+  }
+  for (size_t j = 0; j < DIM; j++) {
+    c[j] = total.v[j] / total.count;
+  }
+  c_extra = 0;
+  if constexpr (Metric::normalized) {
+    normalize(c);
+  }
+  if constexpr (Metric::augmented) {
+    c_extra = total.extra / total.count;
+  }
+  c_norm2 = Metric::normalized ? 1 : kernels::dot_f32<DIM>(c.data(), c.data()) + c_extra * c_extra;
+  return true;
+}
+
+template <size_t DIM, typename Metric>
+void BallTree<DIM, Metric>::constructBalltree(const Words<DIM>& all_words, unsigned threads) {
+  mapping.close();
+  this->all_words = &all_words;
+  threads = max(1u, threads);
+  norms.compute(all_words, threads);
+  order.resize(all_words.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = (int)i;
+  }
+  goes_left.assign(order.size(), 0);
+  if (split == BallSplit::PCAMedian) {
+    split_keys.assign(order.size(), 0.0f);
+  }
+  node_count = 0;
+  unique_ptr<WorkStealingPool> workers;
+  if (threads > 1) {
+    workers = make_unique<WorkStealingPool>(threads);
+    pool = workers.get();
+  }
+  root = constructBalltreeHelper(0, order.size(), all_words);
+  pool = nullptr;
+  goes_left = vector<char>();
+  split_keys = vector<float>();
+
+  // Freeze the tree for searching. With setLeafRows, leaf rows are copied in traversal order when the scan reads
+  // fp32 rows with the blocked kernel; otherwise, and for early abandoning and the reduced-precision formats,
+  // leaves read their rows through Words.
+  owned_nodes.clear();
+  owned_nodes.reserve(node_count);
+  owned_centers = allocateAligned(max<size_t>(1, node_count) * DIM);
+  freeze(root);
+  root = nullptr;
+  owned_leaf_rows.reset();
+  if (copy_leaf_rows && all_words.getStorage() == Storage::F32 && !all_words.canAbandon()) {
+    owned_leaf_rows = allocateAligned(max<size_t>(1, order.size()) * DIM);
+    for (size_t i = 0; i < order.size(); i++) {
+      copy_n(all_words.row(order[i]), DIM, owned_leaf_rows.get() + i * DIM);
+    }
+  }
+  nodes = owned_nodes.data();
+  node_total = owned_nodes.size();
+  centers = owned_centers.get();
+  row_ids = order.data();
+  row_total = order.size();
+  leaf_rows = owned_leaf_rows.get();
+}
+
+template <size_t DIM, typename Metric>
+bool BallTree<DIM, Metric>::saveIndex(string fileName) const {
+  BallTreeFileHeader header = {};
+  memcpy(header.magic, BALL_TREE_FILE_MAGIC, sizeof(header.magic));
+  header.version = BALL_TREE_FILE_VERSION;
+  header.byte_order = SNAPSHOT_BYTE_ORDER;
+  header.checksum = all_words != nullptr ? all_words->checksum() : 0;
+  header.rows = row_total;
+  header.node_count = node_total;
+  header.dim = DIM;
+  header.flags = leaf_rows ? BALL_TREE_FILE_LEAF_ROWS : 0;
+  strncpy(header.metric, Metric::name, sizeof(header.metric) - 1);
+  header.split = (uint32_t)split;
+  header.sample_size = sample_size;
+  header.sample_seed = sample_seed;
+  auto align = [](uint64_t offset) {return (offset + 63) / 64 * 64;};
+  header.nodes_offset = align(sizeof(header));
+  header.centers_offset = align(header.nodes_offset + node_total * sizeof(FlatBallNode));
+  header.ids_offset = align(header.centers_offset + node_total * DIM * sizeof(float));
+  header.leaf_rows_offset = leaf_rows ? align(header.ids_offset + row_total * sizeof(int)) : 0;
+
+  ofstream out(fileName, ios::binary | ios::trunc);
+  if (!out.is_open()) {
+    cerr << "Error opening file " << fileName << endl;
+    return false;
+  }
+  uint64_t written = 0;
+  auto write = [&](uint64_t offset, const void *data, uint64_t bytes) {
+    const string padding(offset - written, '\0');
+    out.write(padding.data(), padding.size());
+    out.write(static_cast<const char*>(data), bytes);
+    written = offset + bytes;
+  };
+  write(0, &header, sizeof(header));
+  write(header.nodes_offset, nodes, node_total * sizeof(FlatBallNode));
+  write(header.centers_offset, centers, node_total * DIM * sizeof(float));
+  write(header.ids_offset, row_ids, row_total * sizeof(int));
+  if (leaf_rows) {
+    write(header.leaf_rows_offset, leaf_rows, row_total * DIM * sizeof(float));
+  }
+  if (!out) {
+    cerr << "Error writing ball tree " << fileName << endl;
+    return false;
+  }
+  return true;
+}
+
+template <size_t DIM, typename Metric>
+bool BallTree<DIM, Metric>::loadIndex(string fileName, const Words<DIM>& all_words) {
+  // Searches touch nodes in no particular order, so ask for the whole file up front instead of read-ahead.
+  MappedFile file;
+  if (!file.open(fileName, MADV_WILLNEED)) {
+    return false;
+  }
+  BallTreeFileHeader header;
+  if (file.size() < sizeof(header)) {
+    cerr << "Error: " << fileName << " is too small to be a ball tree" << endl;
+    return false;
+  }
+  memcpy(&header, file.data(), sizeof(header));
+  if (memcmp(header.magic, BALL_TREE_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != BALL_TREE_FILE_VERSION
+      || header.byte_order != SNAPSHOT_BYTE_ORDER) {
+    cerr << "Error: " << fileName << " is not a version " << BALL_TREE_FILE_VERSION << " ball tree for this machine" << endl;
+    return false;
+  }
+  if (header.dim != DIM || strncmp(header.metric, Metric::name, sizeof(header.metric)) != 0) {
+    cerr << "Error: " << fileName << " is not a " << Metric::name << " tree of " << DIM << "-d vectors" << endl;
+    return false;
+  }
+  if (header.rows != all_words.size() || header.checksum != all_words.checksum()) {
+    cerr << "Error: " << fileName << " was built on other rows (a different vocabulary, basis or storage)" << endl;
+    return false;
+  }
+  // Leaf rows are only in the file when they would have been built for this storage, as in constructBalltree.
+  const bool has_leaf_rows = header.flags & BALL_TREE_FILE_LEAF_ROWS;
+  const bool want_leaf_rows = copy_leaf_rows && all_words.getStorage() == Storage::F32 && !all_words.canAbandon();
+  if (header.split != (uint32_t)split || header.sample_size != sample_size || header.sample_seed != sample_seed
+      || has_leaf_rows != want_leaf_rows) {
+    cerr << "Error: " << fileName << " was built with another split rule, sampling or leaf rows setting" << endl;
+    return false;
+  }
+  if (header.nodes_offset % 64 != 0 || header.centers_offset % 64 != 0 || header.ids_offset % 64 != 0
+      || header.leaf_rows_offset % 64 != 0 || header.node_count > 2 * header.rows || (header.rows > 0 && header.node_count == 0)
+      || header.nodes_offset + header.node_count * sizeof(FlatBallNode) > header.centers_offset
+      || header.centers_offset + header.node_count * DIM * sizeof(float) > header.ids_offset
+      || header.ids_offset + header.rows * sizeof(int) > file.size()
+      || (has_leaf_rows && header.leaf_rows_offset + header.rows * DIM * sizeof(float) > file.size())) {
+    cerr << "Error: " << fileName << " is truncated or corrupt" << endl;
+    return false;
+  }
+  // Searches follow the children and read ids[begin, end) without checks, so check them all here. Nodes are in
+  // depth-first order, so a child comes after its parent; that rules out cycles as well.
+  const FlatBallNode *file_nodes = reinterpret_cast<const FlatBallNode*>(file.data() + header.nodes_offset);
+  const int *file_ids = reinterpret_cast<const int*>(file.data() + header.ids_offset);
+  bool nodes_ok = true;
+  for (uint64_t i = 0; i < header.node_count && nodes_ok; i++) {
+    const FlatBallNode& node = file_nodes[i];
+    nodes_ok = (node.left == NO_CHILD || (node.left > i && node.left < header.node_count))
+               && (node.right == NO_CHILD || (node.right > i && node.right < header.node_count))
+               && node.begin <= node.end && node.end <= header.rows;
+  }
+  for (uint64_t i = 0; i < header.rows && nodes_ok; i++) {
+    nodes_ok = file_ids[i] >= 0 && (uint64_t)file_ids[i] < all_words.size();
+  }
+  if (!nodes_ok) {
+    cerr << "Error: " << fileName << " has a corrupt node or id" << endl;
+    return false;
+  }
+
+  // Zero-copy: the nodes, centers, ids and leaf rows are used straight out of the mapping (mmap returns
+  // page-aligned memory, so the 64-byte aligned offsets keep the rows aligned).
+  mapping.close();
+  owned_nodes = vector<FlatBallNode>();
+  owned_centers.reset();
+  owned_leaf_rows.reset();
+  order = vector<int>();
+  this->all_words = &all_words;
+  norms.compute(all_words);
+  nodes = file_nodes;
+  node_total = header.node_count;
+  centers = reinterpret_cast<const float*>(file.data() + header.centers_offset);
+  row_ids = file_ids;
+  row_total = header.rows;
+  leaf_rows = has_leaf_rows ? reinterpret_cast<const float*>(file.data() + header.leaf_rows_offset) : nullptr;
+  mapping = move(file);
+  return true;
+}
+
+template <size_t DIM, typename Metric>
+uint32_t BallTree<DIM, Metric>::freeze(BallTreeNode *B) {
+  if (B == nullptr) {
+    return NO_CHILD;
+  }
+  const uint32_t i = (uint32_t)owned_nodes.size();
+  FlatBallNode flat;
+  flat.begin = (uint32_t)B->begin;
+  flat.end = (uint32_t)B->end;
+  flat.radius = B->radius;
+  flat.center_extra = B->center_extra;
+  flat.center_norm2 = B->center_norm2;
+  owned_nodes.push_back(flat);
+  copy(B->center.begin(), B->center.end(), owned_centers.get() + (size_t)i * DIM);
+  const uint32_t left = freeze(B->left);
+  const uint32_t right = freeze(B->right);
+  owned_nodes[i].left = left;
+  owned_nodes[i].right = right;
+  delete B;
+  return i;
+}
+
+template <size_t DIM, typename Metric>
+BallTreeShape BallTree<DIM, Metric>::shape() const {
+  BallTreeShape out;
+  if (node_total == 0) {
+    return out;
+  }
+  vector<pair<uint32_t, size_t>> stack = {{0, 0}}; // (node, depth)
+  double row_depth = 0;
+  while (!stack.empty()) {
+    const auto [i, depth] = stack.back();
+    stack.pop_back();
+    const FlatBallNode& node = nodes[i];
+    if (!node.isLeaf()) {
+      stack.push_back({node.left, depth + 1});
+      stack.push_back({node.right, depth + 1});
+      continue;
+    }
+    const size_t size = node.end - node.begin;
+    out.leaves++;
+    out.max_depth = max(out.max_depth, depth);
+    row_depth += (double)depth * size;
+    const size_t bucket = size > 0 ? (size_t)log2((double)size) : 0;
+    if (out.leaf_sizes.size() <= bucket) {
+      out.leaf_sizes.resize(bucket + 1, 0);
+    }
+    out.leaf_sizes[bucket]++;
+  }
+  out.mean_row_depth = row_total == 0 ? 0 : row_depth / row_total;
+  return out;
+}
+
+template <size_t DIM, typename Metric>
+float BallTree<DIM, Metric>::cosine_distance(const float *a, const float *b) {
   return 1 - cosine_similarity(a, b);
 }
 
 /* Psuedocode source: https://en.wikipedia.org/wiki/Ball_tree
     Translated to project context:
-    Note: Objects are stored as knn_Nodes, each having a calculated distance, WordVector, and < operator for min heap processing.
-    1) return immediately if B is a nullptr to avoid segfault.
-    2) else if B.left == nullptr and B.right == nullptr (B is a leaf) then, for each WordVector w in B.words:
-    2a) if cosine_distance(t.vec, w.vec) < cosine_distance(t.vec, Q.top().word.vec) then Q.push(w).
-    2b) if 2a was satisfied and Q.size() > k, then remove the element of Q with the greatest distance value.
-    3) if cosine_distance(t.vec, B.center) - B.radius >= cosine_distance(t.vec, Q.top().word.vec) then return Q unchanged.
-    (repeat for each WordVector x in B.words)
-    4) else (if neither 1 nor 2 were satisfied):
+    Note: Q is a KnnHeap of (id, distance) pairs over the caller's buffer, with room for k; Q.worst() is the greatest
+    kept distance (infinity until k pairs are kept).
+    B is the index of a node of the frozen tree (FlatBallNode), and B.words are the rows of its leaf range.
+    1) return immediately if B is NO_CHILD.
+    2) if no point of the ball can be closer than Q.worst() then return Q unchanged. For cosine the radius is an
+       angle R and the test is the angular triangle inequality: with a = angle(t.vec, B.center), every point is at
+       least max(0, a - R) from t, so skip B if 1 - cos(a - R) >= Q.worst() (CosineMetric::lowerBound). This
+       also skips leaves, not only inner balls.
+    3) else if B.left and B.right are NO_CHILD (B is a leaf) then, for each id w in order[B.begin, B.end):
+    3a) if cosine_distance(t.vec, w.vec) < Q.worst() then push w into Q,
+    3b) removing the element of Q with the greatest distance value if Q was full.
+    4) else:
     4a) if cosine_distance(t.vec, B.left.center) < cosine_distance(t.vec, B.right.center), then child1 = B.left, child2 = B.right.
     4b) else child1 = B.right, child2 = B.left
-    5) recursively call knn_search(t, k, Q, child1) followed by knn_search(t, k, Q, child2).
+    5) recursively call knn_search(t, k, Q, child1) followed by knn_search(t, k, Q, child2), passing the center
+       distances from 4a so (2) does not compute them again.
  */
-void BallTree::knn_search_helper(const WordVector t, int k, priority_queue<knn_Node>& Q, BallTreeNode* B) {
+template <size_t DIM, typename Metric>
+void BallTree<DIM, Metric>::knn_search_helper(const float *t, float tt, KnnHeap& Q, uint32_t B, float B_distance, const AbandonQuery<DIM> *aq,
+                                              const QuantizedQuery<DIM> *q8, BallSearchStats& stats) const {
   // (1)
-  if (B == nullptr) {
+  if (B == NO_CHILD) {
     return;
   }
+  const FlatBallNode& node = nodes[B];
   // (2)
-  if (B->left == nullptr && B->right == nullptr) {
-    for (WordVector &w : B->words) {
-      // (2a)
-      float cos_dist = cosine_distance(t.vec, w.vec);
-      if (cos_dist < cosine_distance(t.vec, Q.top().word.vec)) {
-        Q.push(knn_Node(cos_dist, w));
+  if (Metric::lowerBound(B_distance, node.radius) >= Q.worst()) {
+    return;
+  }
+  // (3)
+  if (node.isLeaf()) {
+    const int *leaf = row_ids + node.begin;
+    const size_t leaf_size = node.end - node.begin;
+    // Score the whole leaf in one blocked kernel call (the query stays in registers), then update Q.
+    // With aq, rows that provably cannot beat Q.worst() are abandoned early and come back as -infinity.
+    float cos_sims[LEAF_BLOCK];
+    size_t dims = 0;
+    for (size_t first = 0; first < leaf_size; first += LEAF_BLOCK) {
+      const size_t n = min(LEAF_BLOCK, leaf_size - first);
+      if (aq != nullptr) {
+        const float worst = Q.worst();
+        all_words->dotAbandonMany(*aq, [&](size_t i) {return leaf[first + i];}, n,
+                                  [&](size_t i) {return Metric::dotForDistance(worst, tt, norms.squaredNorm(leaf[first + i]));}, cos_sims, dims);
+      }
+      else if (q8 != nullptr) {
+        for (size_t i = 0; i < n; i++) {
+          cos_sims[i] = all_words->dotQuantized(*q8, leaf[first + i]);
+        }
+      }
+      else if (leaf_rows) {
+        const float *rows = leaf_rows + (node.begin + first) * DIM;
+        kernels::dot_many_f32<DIM>(t, [rows](size_t i) {return rows + i * DIM;}, n, cos_sims);
       }
-      // (2b)
-      if (Q.size() > k) {
-        Q.pop();
+      else {
+        all_words->dotMany(t, [&](size_t i) {return leaf[first + i];}, n, cos_sims);
+      }
+      for (size_t i = 0; i < n; i++) {
+        // (3a) and (3b)
+        if (cos_sims[i] != -numeric_limits<float>::infinity()) {
+          const int id = leaf[first + i];
+          Q.offer(id, Metric::distance(cos_sims[i], tt, norms.squaredNorm(id)));
+        }
       }
     }
-  }
-  // (3)
-  else if (cosine_distance(t.vec, B->center) - B->radius >= cosine_distance(t.vec, Q.top().word.vec)) {
-    return;
+    if (aq != nullptr) {
+      all_words->countAbandon(leaf_size, dims);
+    }
+    stats.points += leaf_size;
   }
   // (4)
   else {
-    BallTreeNode* child1;
-    BallTreeNode* child2;
-    // (4a)
-    if (cosine_distance(t.vec, B->left->center) < cosine_distance(t.vec, B->right->center)) {
-      child1 = B->left;
-      child2 = B->right;
-    }
-    // (4b)
+    const float left_distance = centerDistance(t, tt, node.left);
+    const float right_distance = centerDistance(t, tt, node.right);
+    stats.centers += 2;
+    // (4a) and (5)
+    if (left_distance < right_distance) {
+      knn_search_helper(t, tt, Q, node.left, left_distance, aq, q8, stats);
+      knn_search_helper(t, tt, Q, node.right, right_distance, aq, q8, stats);
+    }
+    // (4b) and (5)
     else {
-      child1 = B->right;
-      child2 = B->left;
+      knn_search_helper(t, tt, Q, node.right, right_distance, aq, q8, stats);
+      knn_search_helper(t, tt, Q, node.left, left_distance, aq, q8, stats);
     }
-    // (5)
-    knn_search_helper(t, k, Q, child1);
-    knn_search_helper(t, k, Q, child2);
   }
 }
 
-priority_queue<knn_Node> BallTree::knn_search(const WordVector t, int k) {
-  priority_queue<knn_Node> Q;
-  cout << "Searching for " << t.getWord() << "'s nearest semantic neighbors..." << endl;
-  if (k <= 0) {
-    cout << "Error: knn search must be non-negative." << endl;
-    return Q;
-  }
-  cout << endl;
-
-  for (int i = 0; i < k; i++) {
-    WordVector w;
-    Q.push(knn_Node(3, w));
-  }
-  knn_search_helper(t, k+1, Q, getRoot());
-  int rank = 1;
-  vector<string> top_k_words;
-  vector<float> top_k_similarities;
-  cout << "Top " << k << " semantically closest words to " << t.getWord() << " (Ball Tree implementation):\n";
-  while (!Q.empty()) {
-    top_k_words.push_back(Q.top().word.getWord());
-    top_k_similarities.push_back(cosine_similarity(Q.top().word.vec, t.vec));
-    Q.pop();
-  }
-  int vec_size = top_k_words.size();
-  for (int i = vec_size-1; i > 0; i--) {
-    cout << "[" << rank++ << "] " << top_k_words[i] /* << " (similarity: " << top_k_similarities[i] << ")" */<< endl;
-  }
-  return Q;
+template <size_t DIM, typename Metric>
+size_t BallTree<DIM, Metric>::search(const float *q, size_t k, pair<int,float> *out) const {
+  k = min(k, row_total);
+  if (k == 0) {
+    return 0;
+  }
+  const size_t depth = (all_words->canRerank() && rerank_depth > (int)k) ? min((size_t)rerank_depth, row_total) : k;
+  // A rerank shortlist is deeper than out, so it is kept in a per-thread buffer that only ever grows.
+  static thread_local vector<pair<int,float>> shortlist;
+  if (depth > k && shortlist.size() < depth) {
+    shortlist.resize(depth);
+  }
+  KnnHeap Q(depth > k ? shortlist.data() : out, depth);
+  const float qq = Metric::normalized ? 1 : kernels::dot_f32<DIM>(q, q);
+  AbandonQuery<DIM> aq;
+  if (all_words->canAbandon()) {
+    all_words->prepareAbandon(q, aq);
+  }
+  // int8 storage: the query is quantized once and the leaves are scored int8 x int8, as in BruteForceIndex.
+  QuantizedQuery<DIM> q8;
+  const bool quantized = isQuantized(all_words->getStorage());
+  if (quantized) {
+    all_words->quantizeQuery(q, q8);
+  }
+  BallSearchStats stats;
+  knn_search_helper(q, qq, Q, getRoot(), centerDistance(q, qq, getRoot()), all_words->canAbandon() ? &aq : nullptr,
+                    quantized ? &q8 : nullptr, stats);
+  stat_queries.fetch_add(1, memory_order_relaxed);
+  stat_centers.fetch_add(stats.centers + 1, memory_order_relaxed);
+  stat_points.fetch_add(stats.points, memory_order_relaxed);
+  Q.sortNearestFirst();
+  if (depth == k) {
+    // (id, distance) -> (id, similarity), from the same dot product the results were ranked by (int8 x int8
+    // with quantized storage), so the reported similarities follow the order.
+    for (size_t i = 0; i < Q.count; i++) {
+      const float xx = norms.squaredNorm(out[i].first);
+      out[i].second = Metric::similarity(Metric::dotForDistance(out[i].second, qq, xx), qq, xx);
+    }
+    return Q.count;
+  }
+
+  // Rerank: rescore the depth candidates with the exact fp32 rows and keep the k best.
+  vector<int> candidates(Q.count);
+  for (size_t i = 0; i < Q.count; i++) {
+    candidates[i] = Q.items[i].first;
+  }
+  auto similarity = [&](int id, float dot) {return Metric::similarity(dot, qq, norms.squaredNorm(id));};
+  const vector<pair<int,float>> best = all_words->rerank(q, candidates, k, similarity);
+  copy(best.begin(), best.end(), out);
+  return best.size();
 }
 
 #endif //BALLTREE_H
@@ -0,0 +1,169 @@
+#ifndef BASIS_H
+#define BASIS_H
+#include <string>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "Parallel.h"
+using namespace std;
+
+// Coordinates Words keeps its rows in (see Words::setBasis). Rotating every row and query by the same
+// orthonormal matrix leaves dot products, cosines and distances unchanged, but puts most of each vector's
+// length into the leading dimensions, which is what early abandoning needs.
+enum class Basis {
+  Original, // Dimensions as they are in the file
+  Variance, // The file's dimensions, sorted by decreasing mean square
+  PCA       // Principal axes of the rows, by decreasing eigenvalue
+};
+
+inline string basisName(Basis b) {
+  switch (b) {
+    case Basis::Variance: return "variance";
+    case Basis::PCA: return "pca";
+    default: return "file";
+  }
+}
+
+// Parses "file" / "variance" / "pca". Returns false for anything else.
+inline bool parseBasis(const string& name, Basis& out) {
+  for (Basis b : {Basis::Original, Basis::Variance, Basis::PCA}) {
+    if (name == basisName(b)) {
+      out = b;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Eigen-decomposition of the symmetric n x n matrix a (row-major, destroyed) by cyclic Jacobi rotations,
+   referenced from https://en.wikipedia.org/wiki/Jacobi_eigenvalue_algorithm and Numerical Recipes 11.1:
+    1. Sweep over every off-diagonal pair (p, q) and apply the rotation that zeroes a[p][q].
+    2. Accumulate the rotations in v, whose columns converge to the eigenvectors.
+    3. Stop when the off-diagonal mass is negligible next to the diagonal; the diagonal holds the eigenvalues.
+   n is at most a few hundred here, so the O(n^3) sweeps take milliseconds.
+*/
+inline void symmetricEigen(vector<double>& a, size_t n, vector<double>& values, vector<double>& v) {
+  v.assign(n * n, 0.0);
+  for (size_t i = 0; i < n; i++) {
+    v[i * n + i] = 1.0;
+  }
+  for (int sweep = 0; sweep < 100; sweep++) {
+    // (3)
+    double off = 0, diag = 0;
+    for (size_t p = 0; p < n; p++) {
+      diag += a[p * n + p] * a[p * n + p];
+      for (size_t q = p + 1; q < n; q++) {
+        off += a[p * n + q] * a[p * n + q];
+      }
+    }
+    if (off <= 1e-24 * diag) {
+      break;
+    }
+    // (1)
+    for (size_t p = 0; p < n; p++) {
+      for (size_t q = p + 1; q < n; q++) {
+        const double apq = a[p * n + q];
+        if (fabs(apq) < 1e-300) {
+          continue;
+        }
+        const double theta = (a[q * n + q] - a[p * n + p]) / (2 * apq);
+        const double t = (theta >= 0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1));
+        const double c = 1 / sqrt(t * t + 1), s = t * c;
+        for (size_t k = 0; k < n; k++) { // Columns p and q
+          const double akp = a[k * n + p], akq = a[k * n + q];
+          a[k * n + p] = c * akp - s * akq;
+          a[k * n + q] = s * akp + c * akq;
+        }
+        for (size_t k = 0; k < n; k++) { // Rows p and q
+          const double apk = a[p * n + k], aqk = a[q * n + k];
+          a[p * n + k] = c * apk - s * aqk;
+          a[q * n + k] = s * apk + c * aqk;
+        }
+        // (2)
+        for (size_t k = 0; k < n; k++) {
+          const double vkp = v[k * n + p], vkq = v[k * n + q];
+          v[k * n + p] = c * vkp - s * vkq;
+          v[k * n + q] = s * vkp + c * vkq;
+        }
+      }
+    }
+  }
+  values.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    values[i] = a[i * n + i];
+  }
+}
+
+const size_t BASIS_SAMPLE_ROWS = 50000; // Rows the second-moment matrix is estimated from (evenly spaced)
+
+/* Orthonormal DIM x DIM matrix B (row-major) for Words::setBasis; a row x is stored as B x.
+    1. Estimate the second-moment matrix S = mean(x x^T) over up to BASIS_SAMPLE_ROWS rows, one partial sum per
+       thread. The moments are taken about 0, not the mean, because the early-abandoning bound depends on how
+       much of |x| is left in the trailing dimensions, and the rows are not centered.
+    2. Variance: the diagonal of S sorted in decreasing order gives a permutation of the dimensions.
+       PCA: the eigenvectors of S by decreasing eigenvalue (symmetricEigen) are the rows of B.
+*/
+template <size_t DIM>
+vector<float> computeBasis(const float *rows, size_t count, Basis basis, unsigned threads = defaultThreadCount()) {
+  vector<float> B(DIM * DIM, 0.0f);
+  if (basis == Basis::Original || count == 0) {
+    for (size_t i = 0; i < DIM; i++) {
+      B[i * DIM + i] = 1.0f;
+    }
+    return B;
+  }
+  // (1)
+  const size_t samples = min(count, BASIS_SAMPLE_ROWS);
+  const bool full = basis == Basis::PCA; // Variance only needs the diagonal
+  vector<vector<double>> partial(threads, vector<double>(full ? DIM * DIM : DIM, 0.0));
+  runThreads(threads, [&](unsigned t) {
+    vector<double>& S = partial[t];
+    for (size_t i = samples * t / threads; i < samples * (t + 1) / threads; i++) {
+      const float *x = rows + (i * count / samples) * DIM;
+      for (size_t p = 0; p < DIM; p++) {
+        if (!full) {
+          S[p] += (double)x[p] * x[p];
+          continue;
+        }
+        for (size_t q = p; q < DIM; q++) {
+          S[p * DIM + q] += (double)x[p] * x[q];
+        }
+      }
+    }
+  });
+  vector<double> S = partial[0];
+  for (unsigned t = 1; t < threads; t++) {
+    for (size_t i = 0; i < S.size(); i++) {
+      S[i] += partial[t][i];
+    }
+  }
+
+  // (2)
+  vector<size_t> order(DIM);
+  for (size_t i = 0; i < DIM; i++) {
+    order[i] = i;
+  }
+  if (!full) {
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {return S[a] > S[b];});
+    for (size_t i = 0; i < DIM; i++) {
+      B[i * DIM + order[i]] = 1.0f;
+    }
+    return B;
+  }
+  for (size_t p = 0; p < DIM; p++) {
+    for (size_t q = 0; q < p; q++) {
+      S[p * DIM + q] = S[q * DIM + p];
+    }
+  }
+  vector<double> values, vectors;
+  symmetricEigen(S, DIM, values, vectors);
+  stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {return values[a] > values[b];});
+  for (size_t i = 0; i < DIM; i++) {
+    for (size_t j = 0; j < DIM; j++) {
+      B[i * DIM + j] = (float)vectors[j * DIM + order[i]];
+    }
+  }
+  return B;
+}
+
+#endif //BASIS_H
@@ -0,0 +1,219 @@
+#ifndef BRUTEFORCE_H
+#define BRUTEFORCE_H
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include "Words.h"
+#include "Metrics.h"
+#include "Parallel.h"
+using namespace std;
+
+const size_t BRUTE_FORCE_BLOCK = 256; // Rows scored per kernel call; 1 KB of scores stays in L1
+const size_t BRUTE_FORCE_MIN_ROWS_PER_THREAD = 8192; // Smaller slices cost more to start a thread for than they save
+
+// The best k (id, similarity) pairs offered so far. A min-heap on similarity, so top() is the worst one kept.
+class TopK {
+  private:
+    struct Worse {
+      bool operator()(const pair<int,float>& a, const pair<int,float>& b) const {return a.second > b.second;}
+    };
+    size_t k;
+    priority_queue<pair<int,float>, vector<pair<int,float>>, Worse> best;
+  public:
+    explicit TopK(size_t k = 0) : k(k) {}
+    // Smallest similarity a new pair needs to be kept (-infinity until k pairs are kept).
+    float threshold() const {return (k > 0 && best.size() == k) ? best.top().second : -numeric_limits<float>::infinity();}
+    void offer(int id, float cs) {
+      if (best.size() < k) {
+        best.push({id, cs});
+      }
+      else if (k > 0 && cs > best.top().second) {
+        best.pop();
+        best.push({id, cs});
+      }
+    }
+    // Offers everything other kept (used to merge per-thread results), emptying other.
+    void merge(TopK& other) {
+      for (; !other.best.empty(); other.best.pop()) {
+        offer(other.best.top().first, other.best.top().second);
+      }
+    }
+    // The kept pairs, best first. Empties the heap.
+    vector<pair<int,float>> take() {
+      vector<pair<int,float>> result(best.size());
+      for (size_t i = result.size(); i-- > 0; ) {
+        result[i] = best.top();
+        best.pop();
+      }
+      return result;
+    }
+};
+
+/* Exact k nearest neighbors by the metric (cosine by default, see Metrics.h), scanning every row. This is the reference answer the trees and the
+   reduced-precision storage modes are checked against, and an engine in its own right.
+    1. The rows are cut into one contiguous slice per thread (no slice smaller than BRUTE_FORCE_MIN_ROWS_PER_THREAD).
+    2. Each thread scores its slice BRUTE_FORCE_BLOCK rows at a time with the blocked SIMD kernels and keeps
+       its own top-k heap, so the threads share nothing while they scan. When the rows are in a variance-ordered
+       basis (Words::canAbandon), each block is scored with early abandoning against the heap's threshold
+       (Words::dotAbandonMany), and rows that provably cannot make the top k are skipped.
+    3. The per-thread heaps are merged into one top-k at the end.
+   With INT8 / INT8_DIM storage the scan scores int8 x int8; if the rerank depth is > k and fp32 rows are
+   available, the best rerank_depth candidates are then rescored exactly and the best k of those are returned.
+*/
+template <size_t DIM, typename Metric = CosineMetric>
+class BruteForceIndex {
+  private:
+    const Words<DIM>& words;
+    unsigned threads;
+    size_t rerank_depth = 0;
+    RowNorms<DIM, Metric> norms; // |x|^2 per row for L2
+
+    unsigned threadsFor(size_t rows) const {
+      return (unsigned)max<size_t>(1, min<size_t>(threads, rows / BRUTE_FORCE_MIN_ROWS_PER_THREAD));
+    }
+    // (2) for one query over rows [begin, end).
+    void scan(const float *q, const QuantizedQuery<DIM> *qq, size_t begin, size_t end, TopK& best) const;
+    float similarity(float dot, float q_norm2, size_t id) const {return Metric::similarity(dot, q_norm2, norms.squaredNorm(id));}
+  public:
+    explicit BruteForceIndex(const Words<DIM>& words, unsigned threads = defaultThreadCount()) : words(words), threads(max(1u, threads)) {
+      norms.compute(words, this->threads);
+    }
+
+    void setRerankDepth(size_t depth) {rerank_depth = depth;}
+    unsigned getThreads() const {return threads;}
+
+    // The k nearest rows to q as (id, similarity) pairs, best first. The similarity is the cosine for cosine.
+    vector<pair<int,float>> knn(const float *q, size_t k) const;
+    // knn for many queries at once, on the current storage without reranking. Each block of rows is scored
+    // against the whole batch with the many-to-many kernel, so every row is read once per batch instead of
+    // once per query. Returns one best-first list per query.
+    vector<vector<pair<int,float>>> knnBatch(const vector<const float*>& queries, size_t k) const;
+};
+
+template <size_t DIM, typename Metric>
+void BruteForceIndex<DIM, Metric>::scan(const float *q, const QuantizedQuery<DIM> *qq, size_t begin, size_t end, TopK& best) const {
+  const float q_norm2 = Metric::normalized ? 1 : kernels::dot_f32<DIM>(q, q);
+  const bool abandon = qq == nullptr && words.canAbandon();
+  AbandonQuery<DIM> aq;
+  if (abandon) {
+    words.prepareAbandon(q, aq);
+  }
+  size_t dims = 0;
+  float cos_sims[BRUTE_FORCE_BLOCK];
+  for (size_t first = begin; first < end; first += BRUTE_FORCE_BLOCK) {
+    const size_t n = min(BRUTE_FORCE_BLOCK, end - first);
+    if (qq != nullptr) {
+      for (size_t i = 0; i < n; i++) {
+        cos_sims[i] = words.dotQuantized(*qq, first + i);
+      }
+    }
+    else if (abandon) {
+      // Rows that cannot beat the worst kept one come back as -infinity and are skipped below.
+      const float threshold = best.threshold();
+      words.dotAbandonMany(aq, [first](size_t i) {return first + i;}, n,
+                           [&](size_t i) {return Metric::dotForSimilarity(threshold, q_norm2, norms.squaredNorm(first + i));}, cos_sims, dims);
+    }
+    else {
+      words.dotMany(q, [first](size_t i) {return first + i;}, n, cos_sims);
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (cos_sims[i] != -numeric_limits<float>::infinity()) {
+        best.offer((int)(first + i), similarity(cos_sims[i], q_norm2, first + i));
+      }
+    }
+  }
+  if (abandon) {
+    words.countAbandon(end - begin, dims);
+  }
+}
+
+template <size_t DIM, typename Metric>
+vector<pair<int,float>> BruteForceIndex<DIM, Metric>::knn(const float *q, size_t k) const {
+  const size_t rows = words.size();
+  k = min(k, rows);
+  if (k == 0) {
+    return {};
+  }
+  const size_t K = k;
+  if (words.canRerank() && rerank_depth > k) {
+    k = min(rerank_depth, rows);
+  }
+  QuantizedQuery<DIM> qq;
+  const bool quantized = isQuantized(words.getStorage());
+  if (quantized) {
+    words.quantizeQuery(q, qq);
+  }
+
+  // (1)
+  const unsigned t_count = threadsFor(rows);
+  vector<TopK> best(t_count, TopK(k));
+  runThreads(t_count, [&](unsigned t) {
+    scan(q, quantized ? &qq : nullptr, rows * t / t_count, rows * (t + 1) / t_count, best[t]);
+  });
+  // (3)
+  for (unsigned t = 1; t < t_count; t++) {
+    best[0].merge(best[t]);
+  }
+  vector<pair<int,float>> result = best[0].take();
+  if (k == K) {
+    return result;
+  }
+  vector<int> candidates;
+  for (const pair<int,float>& r : result) {
+    candidates.push_back(r.first);
+  }
+  const float q_norm2 = Metric::normalized ? 1 : kernels::dot_f32<DIM>(q, q);
+  return words.rerank(q, candidates, K, [&](int id, float dot) {return similarity(dot, q_norm2, id);});
+}
+
+template <size_t DIM, typename Metric>
+vector<vector<pair<int,float>>> BruteForceIndex<DIM, Metric>::knnBatch(const vector<const float*>& queries, size_t k) const {
+  const size_t rows = words.size();
+  const size_t nq = queries.size();
+  k = min(k, rows);
+  const unsigned t_count = threadsFor(rows);
+  vector<vector<TopK>> best(t_count, vector<TopK>(nq, TopK(k)));
+  vector<float> q_norm2(nq, 1.0f);
+  for (size_t j = 0; j < nq && !Metric::normalized; j++) {
+    q_norm2[j] = kernels::dot_f32<DIM>(queries[j], queries[j]);
+  }
+  runThreads(t_count, [&](unsigned t) {
+    vector<float> cos_sims(nq * BRUTE_FORCE_BLOCK);
+    const size_t end = rows * (t + 1) / t_count;
+    for (size_t first = rows * t / t_count; first < end && k > 0; first += BRUTE_FORCE_BLOCK) {
+      const size_t n = min(BRUTE_FORCE_BLOCK, end - first);
+      words.dotBatch(queries.data(), nq, first, n, cos_sims.data());
+      for (size_t j = 0; j < nq; j++) {
+        for (size_t i = 0; i < n; i++) {
+          best[t][j].offer((int)(first + i), similarity(cos_sims[j * n + i], q_norm2[j], first + i));
+        }
+      }
+    }
+  });
+  vector<vector<pair<int,float>>> result(nq);
+  for (size_t j = 0; j < nq; j++) {
+    for (unsigned t = 1; t < t_count; t++) {
+      best[0][j].merge(best[t][j]);
+    }
+    result[j] = best[0][j].take();
+  }
+  return result;
+}
+
+// Fraction of the ids in truth that also appear in found (recall@k with k = truth.size()).
+inline double recallAtK(const vector<pair<int,float>>& truth, const vector<int>& found) {
+  if (truth.empty()) {
+    return 1.0;
+  }
+  size_t hits = 0;
+  for (const pair<int,float>& t : truth) {
+    if (find(found.begin(), found.end(), t.first) != found.end()) {
+      hits++;
+    }
+  }
+  return (double)hits / truth.size();
+}
+
+#endif //BRUTEFORCE_H
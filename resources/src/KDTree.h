@@ -7,43 +7,29 @@
 #include <limits>
 #include <cmath>
 #include "Words.h"
+#include "Metrics.h"
 using namespace std;
 
-//KD-tree over unit-normalized embeddings (cosine == dot)
-//build(), knn(q, K) -> vector<pair<index, cosine>>
+//KD-tree over unit-normalized embeddings (cosine == dot), or raw ones with the L2 / inner-product metrics (Metrics.h)
+//build(), knn(q, K) -> vector<pair<index, similarity>> (cosine, -L2 distance or inner product)
 
 namespace kd_detail {
 
-/* Cosine and Euclidean for the unit vectors
-   - https://en.wikipedia.org/wiki/Cosine_similarity  “Cosine distance” and “L2-normalized Euclidean distance”:
-        ||A−B||^2 = 2(1 − cos(A,B)) -> cos_to_dist2(c) = 2 − 2c )
-   - https://scikit-learn.org/stable/modules/generated/sklearn.metrics.pairwise.cosine_distances.html
-        cosine distance = 1 − cosine similarity; common in NN search with normalized vectors
-*/
-
-//cosine for unit vectors == dot product
-inline float dot_unit(const vector<float>& a, const vector<float>& b) {
-    float s = 0.0f; const size_t n = a.size();
-    for(size_t i = 0; i < n; ++i) {
-        s += a[i] * b[i];
-    }
-    return s;
-}
-
-//convert cosine to squared Euclidean |q - x|^2 = 2 - 2*(q·x)
-inline float cos_to_dist2(float cos_sim) { return 2.0f - 2.0f * cos_sim; }
-
-//pick two pivots that are as dissimilar as possible by cosine
-inline pair<int,int> farthest_pair_by_cosine(const vector<int>& idx, const vector<WordVector>& D) {
+//pick two pivots that are as dissimilar as possible by the metric (lowest cosine for cosine)
+template <size_t DIM, typename Metric>
+inline pair<int,int> farthest_pair_by_cosine(const vector<int>& idx, const Words<DIM>& D, const RowNorms<DIM, Metric>& norms) {
     if (idx.empty()) return {-1,-1};
     const int a = idx.front();
 
     auto argmin_dot = [&](int base)->int{
-        float best = numeric_limits<float>::infinity();
+        float best = -numeric_limits<float>::infinity(); //greatest distance so far
         int arg = -1;
+        float qb[DIM];
+        D.decode(base, qb);
+        const float base_extra = norms.extra(base), base_norm2 = norms.squaredNorm(base);
         for (int id : idx) {
-            float v = dot_unit(D[base].vec, D[id].vec);
-            if (v < best) { best = v; arg = id; }
+            float v = Metric::distance(D.dot(qb, id) + base_extra * norms.extra(id), base_norm2, norms.squaredNorm(id));
+            if (v > best) { best = v; arg = id; }
         }
         return arg;
     };
@@ -57,6 +43,7 @@ inline pair<int,int> farthest_pair_by_cosine(const vector<int>& idx, const vecto
 
 } //namespace kd_detail
 
+template <size_t DIM, typename Metric = CosineMetric>
 class KDTree {
 public:
     struct Node {
@@ -68,11 +55,12 @@ public:
         bool is_leaf() const { return !left && !right; }
     };
 
-    KDTree(const vector<WordVector>& data, size_t leaf_sz = 64)
-        : D(data), dim(data.empty() ? 0 : data[0].vec.size()),
+    KDTree(const Words<DIM>& data, size_t leaf_sz = 64)
+        : D(data),
           leaf_size(max<size_t>(1, leaf_sz)) {}
 
     void build() {
+        norms.compute(D);
         vector<int> idx(D.size());
         for (size_t i = 0; i < idx.size(); ++i) idx[i] = i;
         root = build_rec(idx);
@@ -80,21 +68,40 @@ public:
 
     const Node* getRoot() const { return root.get(); }
 
-    //k-NN by cosine returns (index, cosine)
-    vector<pair<int,float>> knn(const vector<float>& q, size_t K) const {
+    //with quantized storage, search depth candidates and rescore them with fp32 rows (only if depth > K)
+    void set_rerank_depth(size_t depth) { rerank_depth = depth; }
+
+    //k-NN by the metric returns (index, similarity), e.g. (index, cosine)
+    vector<pair<int,float>> knn(const float* q, size_t K) const {
         if (K == 0) return {};
         K = min(K, D.size());
+        const size_t depth = (D.canRerank() && rerank_depth > K) ? min(rerank_depth, D.size()) : K;
+        const float qq = Metric::normalized ? 1.0f : kernels::dot_f32<DIM>(q, q);
         vector<pair<int,float>> best;
-        best.reserve(K);
-        float min_kept_cos = -1.0f; //worst kept cosine
-        knn_rec(root.get(), q, K, best, min_kept_cos);
-        return best;
+        best.reserve(depth);
+        float min_kept_cos = -numeric_limits<float>::infinity(); //worst kept similarity
+        AbandonQuery<DIM> aq;
+        if (D.canAbandon()) D.prepareAbandon(q, aq);
+        //int8 storage: quantize the query once and score the buckets int8 x int8 (as BruteForceIndex does)
+        QuantizedQuery<DIM> q8;
+        const bool quantized = isQuantized(D.getStorage());
+        if (quantized) D.quantizeQuery(q, q8);
+        knn_rec(root.get(), q, qq, D.canAbandon() ? &aq : nullptr, quantized ? &q8 : nullptr, depth, best, min_kept_cos);
+        if (depth == K) return best;
+
+        //exact rescoring of the shortlist
+        vector<int> candidates;
+        candidates.reserve(best.size());
+        for (auto& b : best) candidates.push_back(b.first);
+        return D.rerank(q, candidates, K, [&](int id, float dot){ return Metric::similarity(dot, qq, norms.squaredNorm(id)); });
     }
 
 private:
-    const vector<WordVector>& D;
-    const size_t dim;
+    const Words<DIM>& D; //rows are read in place from the Words matrix
     const size_t leaf_size;
+    static constexpr size_t LEAF_BLOCK = 64; //rows per dotMany call in a leaf scan
+    size_t rerank_depth = 0; //0 = no rerank
+    RowNorms<DIM, Metric> norms; //row norms / augmented coordinates for the L2 and inner-product metrics
     unique_ptr<Node> root;
 
     /* Pseudocode source: https://en.wikipedia.org/wiki/K-d_tree for construction
@@ -120,12 +127,12 @@ private:
         }
 
         //choose axis using two cosine-dissimilar pivots
-        auto [b, c] = kd_detail::farthest_pair_by_cosine(idx, D);
+        auto [b, c] = kd_detail::farthest_pair_by_cosine(idx, D, norms);
         if (b < 0 || c < 0) { n->bucket = idx; return n; }
 
         int best_axis = 0; float best_gap = -1.0f;
-        for (size_t a = 0; a < dim; ++a) {
-            float gap = fabs(D[b].vec[a] - D[c].vec[a]);
+        for (size_t a = 0; a < DIM; ++a) {
+            float gap = fabs(D.value(b, a) - D.value(c, a));
             if (gap > best_gap) { best_gap = gap; best_axis = (int)a; }
         }
         n->axis = best_axis;
@@ -134,13 +141,13 @@ private:
         vector<int> work = idx;
         auto mid_it = work.begin() + work.size()/2;
         nth_element(work.begin(), mid_it, work.end(),
-            [&](int i, int j){ return D[i].vec[best_axis] < D[j].vec[best_axis]; });
-        n->split = D[*mid_it].vec[best_axis];
+            [&](int i, int j){ return D.value(i, best_axis) < D.value(j, best_axis); });
+        n->split = D.value(*mid_it, best_axis);
 
         vector<int> L; L.reserve(work.size()/2 + 1);
         vector<int> R; R.reserve(work.size()/2 + 1);
         for (int id : work) {
-            (D[id].vec[best_axis] < n->split ? L : R).push_back(id);
+            (D.value(id, best_axis) < n->split ? L : R).push_back(id);
         }
         if (L.empty() || R.empty()) { //ensuring both sides are not empty
             L.clear(); R.clear();
@@ -161,15 +168,19 @@ private:
         Similarity = dot(q, x).
         Maintain min_kept_cos among K best.
         Plane-crossing test is if (q[a]−split)^2 <= best_dist2, where best_dist2 = 2 − 2*min_kept_cos, then the far branch might improve the result then recurse there.
+    Other metrics: similarity and best_dist2 come from Metric (-|q-x| and its square for L2; q.x and |q|^2 + M^2 − 2*q.x
+        for inner product, the squared distance in the augmented space, whose extra coordinate is never a split axis).
     */
 
     //search
-    void knn_rec(const Node* node, const vector<float>& q, size_t K, vector<pair<int,float>>& best, float& min_kept_cos) const {
+    //aq is q prepared for early abandoning (nullptr: score leaves with the blocked kernel)
+    //q8 is q quantized for int8 storage (nullptr otherwise)
+    void knn_rec(const Node* node, const float* q, float qq, const AbandonQuery<DIM>* aq, const QuantizedQuery<DIM>* q8, size_t K, vector<pair<int,float>>& best, float& min_kept_cos) const {
         if (!node) return;
 
         if (node->is_leaf()) {
-            for (int id : node->bucket) {
-                float cs = kd_detail::dot_unit(q, D[id].vec);
+            const vector<int>& bucket = node->bucket;
+            auto keep = [&](int id, float cs) {
                 if (best.size() < K) {
                     best.emplace_back(id, cs);
                     if (best.size() == K) {
@@ -186,7 +197,30 @@ private:
                     best.pop_back();
                     min_kept_cos = best.back().second;
                 }
+            };
+            //score the bucket with the blocked kernel (query held in registers), then merge into best
+            //with aq, rows that provably cannot beat min_kept_cos are abandoned early and come back as -infinity
+            float scores[LEAF_BLOCK];
+            size_t dims = 0;
+            for (size_t first = 0; first < bucket.size(); first += LEAF_BLOCK) {
+                const size_t n = min(LEAF_BLOCK, bucket.size() - first);
+                if (aq) {
+                    const bool full = best.size() == K;
+                    const float kept = min_kept_cos;
+                    D.dotAbandonMany(*aq, [&](size_t i){ return bucket[first + i]; }, n, [&](size_t i){
+                        return full ? Metric::dotForSimilarity(kept, qq, norms.squaredNorm(bucket[first + i])) : -numeric_limits<float>::infinity();
+                    }, scores, dims);
+                } else if (q8) {
+                    for (size_t j = 0; j < n; ++j) scores[j] = D.dotQuantized(*q8, bucket[first + j]);
+                } else {
+                    D.dotMany(q, [&](size_t i){ return bucket[first + i]; }, n, scores);
+                }
+                for (size_t j = 0; j < n; ++j) {
+                    const int id = bucket[first + j];
+                    if (scores[j] != -numeric_limits<float>::infinity()) keep(id, Metric::similarity(scores[j], qq, norms.squaredNorm(id)));
+                }
             }
+            if (aq) D.countAbandon(bucket.size(), dims);
             return;
         }
 
@@ -195,15 +229,15 @@ private:
         const Node* far  = (q[a] < node->split ? node->right.get() : node->left.get());
 
         //near first
-        knn_rec(near, q, K, best, min_kept_cos);
+        knn_rec(near, q, qq, aq, q8, K, best, min_kept_cos);
 
         //visit far if distance allows
         float diff = q[a] - node->split;
         float best_dist2 = (best.size() < K)
             ? numeric_limits<float>::infinity()
-            : kd_detail::cos_to_dist2(min_kept_cos);
+            : Metric::euclidean2(min_kept_cos, qq, norms.augmentation());
         if (diff*diff <= best_dist2) {
-            knn_rec(far, q, K, best, min_kept_cos);
+            knn_rec(far, q, qq, aq, q8, K, best, min_kept_cos);
         }
     }
 };
@@ -0,0 +1,707 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+using namespace std;
+
+// Dot-product kernels shared by Words, BallTree and KDTree. The query is fp32 (or int8 for dot_i8); the stored
+// row can be fp32, a 16-bit format or int8, widened on the fly, so reduced storage never needs a decoded copy.
+namespace kernels {
+
+/* IEEE 754 half precision <-> float, referenced from https://en.wikipedia.org/wiki/Half-precision_floating-point_format
+   half: 1 sign bit, 5 exponent bits (bias 15), 10 mantissa bits. Normalized embeddings are in [-1, 1], so
+   the ~3 significant decimal digits are the only loss that matters in practice. */
+inline float f16_to_f32(uint16_t h) {
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t bits;
+  if (exp == 0x1f) { // Inf / nan
+    bits = sign | 0x7f800000 | (mant << 13);
+  }
+  else if (exp != 0) { // Normal
+    bits = sign | ((exp + 112) << 23) | (mant << 13);
+  }
+  else if (mant == 0) { // Zero
+    bits = sign;
+  }
+  else { // Subnormal: renormalize
+    exp = 113;
+    while ((mant & 0x400) == 0) {
+      mant <<= 1;
+      exp--;
+    }
+    bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+  }
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+// Round to nearest even
+inline uint16_t f32_to_f16(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  uint16_t sign = (bits >> 16) & 0x8000;
+  int32_t exp = (int32_t)((bits >> 23) & 0xff) - 127 + 15;
+  uint32_t mant = bits & 0x7fffff;
+  if (((bits >> 23) & 0xff) == 0xff) { // Inf / nan
+    return sign | 0x7c00 | (mant ? 0x200 : 0);
+  }
+  if (exp >= 0x1f) { // Overflow -> inf
+    return sign | 0x7c00;
+  }
+  if (exp <= 0) { // Subnormal or zero
+    if (exp < -10) {
+      return sign;
+    }
+    mant |= 0x800000;
+    uint32_t shift = 14 - exp;
+    uint32_t half = mant >> shift;
+    uint32_t rest = mant & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1))) {
+      half++;
+    }
+    return sign | half;
+  }
+  uint32_t half = ((uint32_t)exp << 10) | (mant >> 13);
+  uint32_t rest = mant & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) { // May carry into the exponent, which is still correct
+    half++;
+  }
+  return sign | (uint16_t)half;
+}
+
+/* bfloat16 <-> float, referenced from https://en.wikipedia.org/wiki/Bfloat16_floating-point_format
+   bf16 is the top half of a float (same 8-bit exponent, 7 mantissa bits), so widening is a shift. */
+inline float bf16_to_f32(uint16_t h) {
+  uint32_t bits = (uint32_t)h << 16;
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+inline uint16_t f32_to_bf16(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  if ((bits & 0x7fffffff) > 0x7f800000) { // Keep nan a nan
+    return (uint16_t)((bits >> 16) | 0x40);
+  }
+  bits += 0x7fff + ((bits >> 16) & 1); // Round to nearest even
+  return (uint16_t)(bits >> 16);
+}
+
+/* Runtime dispatch. Every kernel below exists as a portable scalar loop and, on x86, as SSE2, AVX2+FMA and
+   AVX-512 versions compiled with per-function target attributes, so the binary itself needs no -march flag.
+   The best level the CPU supports is picked once at startup through CPUID (__builtin_cpu_supports), referenced
+   from https://gcc.gnu.org/onlinedocs/gcc/x86-Built-in-Functions.html and
+   https://gcc.gnu.org/onlinedocs/gcc/x86-Function-Attributes.html. Intrinsics referenced from
+   https://www.intel.com/content/www/us/en/docs/intrinsics-guide/index.html
+   Kernels without a version for a level (e.g. fp16 needs F16C, so none for SSE2) fall back to the next one down. */
+enum class SimdLevel {Scalar, SSE2, AVX2, AVX512};
+
+inline const char *simdLevelName(SimdLevel l) {
+  switch (l) {
+    case SimdLevel::SSE2: return "sse2";
+    case SimdLevel::AVX2: return "avx2+fma";
+    case SimdLevel::AVX512: return "avx512";
+    default: return "scalar";
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86 1
+#define KERNELS_SSE2 __attribute__((target("sse2")))
+#define KERNELS_AVX2 __attribute__((target("avx2,fma,f16c")))
+#define KERNELS_AVX512 __attribute__((target("avx512f,avx512bw,avx2,fma,f16c")))
+#endif
+
+// Best level this CPU runs
+inline SimdLevel detectSimdLevel() {
+#ifdef KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+    return SimdLevel::AVX512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) {
+    return SimdLevel::AVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return SimdLevel::SSE2;
+  }
+#endif
+  return SimdLevel::Scalar;
+}
+
+inline const SimdLevel detected_level = detectSimdLevel();
+inline SimdLevel active_level = detected_level; // What the dispatchers use
+
+// Forces a lower level, e.g. to compare kernels; levels above detected_level are clamped
+inline void setSimdLevel(SimdLevel l) {active_level = (l > detected_level) ? detected_level : l;}
+inline SimdLevel simdLevel() {return active_level;}
+
+namespace scalar {
+
+// q . x over DIM floats
+template <size_t DIM>
+inline float dot_f32(const float *q, const float *x) {
+  float s = 0.0f;
+  for (size_t i = 0; i < DIM; i++) {
+    s += q[i] * x[i];
+  }
+  return s;
+}
+
+// q . widen(x) for fp16 rows
+template <size_t DIM>
+inline float dot_f16(const float *q, const uint16_t *x) {
+  float s = 0.0f;
+  for (size_t i = 0; i < DIM; i++) {
+    s += q[i] * f16_to_f32(x[i]);
+  }
+  return s;
+}
+
+// q . widen(x) for bf16 rows
+template <size_t DIM>
+inline float dot_bf16(const float *q, const uint16_t *x) {
+  float s = 0.0f;
+  for (size_t i = 0; i < DIM; i++) {
+    s += q[i] * bf16_to_f32(x[i]);
+  }
+  return s;
+}
+
+// q . x for an int8 row (scale applied by the caller)
+template <size_t DIM>
+inline float dot_i8f(const float *q, const int8_t *x) {
+  float s = 0.0f;
+  for (size_t i = 0; i < DIM; i++) {
+    s += q[i] * (float)x[i];
+  }
+  return s;
+}
+
+// q . (scale * x) for an int8 row with one scale per dimension
+template <size_t DIM>
+inline float dot_i8f_scaled(const float *q, const float *scale, const int8_t *x) {
+  float s = 0.0f;
+  for (size_t i = 0; i < DIM; i++) {
+    s += q[i] * scale[i] * (float)x[i];
+  }
+  return s;
+}
+
+// int8 . int8, accumulated exactly in int32 (DIM * 127 * 127 fits easily)
+template <size_t DIM>
+inline int32_t dot_i8(const int8_t *q, const int8_t *x) {
+  int32_t s = 0;
+  for (size_t i = 0; i < DIM; i++) {
+    s += (int32_t)q[i] * (int32_t)x[i];
+  }
+  return s;
+}
+
+} // namespace scalar
+
+#ifdef KERNELS_X86
+// Each version runs full vectors over the first DIM / width * width values, and the scalar loop (or a masked
+// load on AVX-512) over the rest. DIM is a compile-time constant, so all of the bounds are too.
+
+KERNELS_SSE2 inline float hsum128(__m128 v) {
+  v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+  return _mm_cvtss_f32(v);
+}
+
+KERNELS_AVX2 inline float hsum256(__m256 v) {
+  return hsum128(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+KERNELS_AVX2 inline int32_t hsum256_epi32(__m256i v) {
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+  return _mm_cvtsi128_si32(s);
+}
+
+namespace sse2 {
+
+template <size_t DIM>
+KERNELS_SSE2 inline float dot_f32(const float *q, const float *x) {
+  constexpr size_t B = DIM / 8 * 8;
+  __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps();
+  for (size_t i = 0; i < B; i += 8) {
+    a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(q + i), _mm_loadu_ps(x + i)));
+    a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(q + i + 4), _mm_loadu_ps(x + i + 4)));
+  }
+  float s = hsum128(_mm_add_ps(a0, a1));
+  for (size_t i = B; i < DIM; i++) {
+    s += q[i] * x[i];
+  }
+  return s;
+}
+
+} // namespace sse2
+
+namespace avx2 {
+
+template <size_t DIM>
+KERNELS_AVX2 inline float dot_f32(const float *q, const float *x) {
+  constexpr size_t B = DIM / 16 * 16;
+  __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+  for (size_t i = 0; i < B; i += 16) {
+    a0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), _mm256_loadu_ps(x + i), a0);
+    a1 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i + 8), _mm256_loadu_ps(x + i + 8), a1);
+  }
+  if constexpr (DIM - B >= 8) {
+    a0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + B), _mm256_loadu_ps(x + B), a0);
+  }
+  float s = hsum256(_mm256_add_ps(a0, a1));
+  for (size_t i = B + (DIM - B) / 8 * 8; i < DIM; i++) {
+    s += q[i] * x[i];
+  }
+  return s;
+}
+
+template <size_t DIM>
+KERNELS_AVX2 inline float dot_f16(const float *q, const uint16_t *x) {
+  constexpr size_t B = DIM / 8 * 8;
+  __m256 a = _mm256_setzero_ps();
+  for (size_t i = 0; i < B; i += 8) {
+    __m256 xv = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(x + i)));
+    a = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), xv, a);
+  }
+  float s = hsum256(a);
+  for (size_t i = B; i < DIM; i++) {
+    s += q[i] * f16_to_f32(x[i]);
+  }
+  return s;
+}
+
+template <size_t DIM>
+KERNELS_AVX2 inline float dot_bf16(const float *q, const uint16_t *x) {
+  constexpr size_t B = DIM / 8 * 8;
+  __m256 a = _mm256_setzero_ps();
+  for (size_t i = 0; i < B; i += 8) {
+    __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(x + i)));
+    __m256 xv = _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16));
+    a = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), xv, a);
+  }
+  float s = hsum256(a);
+  for (size_t i = B; i < DIM; i++) {
+    s += q[i] * bf16_to_f32(x[i]);
+  }
+  return s;
+}
+
+template <size_t DIM>
+KERNELS_AVX2 inline float dot_i8f(const float *q, const int8_t *x) {
+  constexpr size_t B = DIM / 8 * 8;
+  __m256 a = _mm256_setzero_ps();
+  for (size_t i = 0; i < B; i += 8) {
+    __m256 xv = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(x + i))));
+    a = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), xv, a);
+  }
+  float s = hsum256(a);
+  for (size_t i = B; i < DIM; i++) {
+    s += q[i] * (float)x[i];
+  }
+  return s;
+}
+
+template <size_t DIM>
+KERNELS_AVX2 inline float dot_i8f_scaled(const float *q, const float *scale, const int8_t *x) {
+  constexpr size_t B = DIM / 8 * 8;
+  __m256 a = _mm256_setzero_ps();
+  for (size_t i = 0; i < B; i += 8) {
+    __m256 xv = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(x + i))));
+    a = _mm256_fmadd_ps(_mm256_mul_ps(_mm256_loadu_ps(q + i), _mm256_loadu_ps(scale + i)), xv, a);
+  }
+  float s = hsum256(a);
+  for (size_t i = B; i < DIM; i++) {
+    s += q[i] * scale[i] * (float)x[i];
+  }
+  return s;
+}
+
+// Sign-extend 16 bytes to int16, then madd multiplies pairs and adds neighbours into int32 lanes
+template <size_t DIM>
+KERNELS_AVX2 inline int32_t dot_i8(const int8_t *q, const int8_t *x) {
+  constexpr size_t B = DIM / 16 * 16;
+  __m256i a = _mm256_setzero_si256();
+  for (size_t i = 0; i < B; i += 16) {
+    __m256i qv = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(q + i)));
+    __m256i xv = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(x + i)));
+    a = _mm256_add_epi32(a, _mm256_madd_epi16(qv, xv));
+  }
+  int32_t s = hsum256_epi32(a);
+  for (size_t i = B; i < DIM; i++) {
+    s += (int32_t)q[i] * (int32_t)x[i];
+  }
+  return s;
+}
+
+} // namespace avx2
+
+// GCC 12 reports its own _mm512_undefined_* placeholders inside the AVX-512 headers as uninitialized
+// (https://gcc.gnu.org/bugzilla/show_bug.cgi?id=105593); the values are never read.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+namespace avx512 {
+
+template <size_t DIM>
+KERNELS_AVX512 inline float dot_f32(const float *q, const float *x) {
+  constexpr size_t B = DIM / 32 * 32;
+  __m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps();
+  for (size_t i = 0; i < B; i += 32) {
+    a0 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), _mm512_loadu_ps(x + i), a0);
+    a1 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i + 16), _mm512_loadu_ps(x + i + 16), a1);
+  }
+  if constexpr (DIM - B >= 16) {
+    a0 = _mm512_fmadd_ps(_mm512_loadu_ps(q + B), _mm512_loadu_ps(x + B), a0);
+  }
+  constexpr size_t T = B + (DIM - B) / 16 * 16;
+  if constexpr (DIM > T) { // Masked tail: lanes past DIM load as 0
+    const __mmask16 m = (__mmask16)((1u << (DIM - T)) - 1);
+    a1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, q + T), _mm512_maskz_loadu_ps(m, x + T), a1);
+  }
+  return _mm512_reduce_add_ps(_mm512_add_ps(a0, a1));
+}
+
+template <size_t DIM>
+KERNELS_AVX512 inline float dot_f16(const float *q, const uint16_t *x) {
+  constexpr size_t B = DIM / 16 * 16;
+  __m512 a = _mm512_setzero_ps();
+  for (size_t i = 0; i < B; i += 16) {
+    __m512 xv = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(x + i)));
+    a = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), xv, a);
+  }
+  float s = _mm512_reduce_add_ps(a);
+  return s + avx2::dot_f16<DIM - B>(q + B, x + B);
+}
+
+template <size_t DIM>
+KERNELS_AVX512 inline float dot_bf16(const float *q, const uint16_t *x) {
+  constexpr size_t B = DIM / 16 * 16;
+  __m512 a = _mm512_setzero_ps();
+  for (size_t i = 0; i < B; i += 16) {
+    __m512i wide = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(x + i)));
+    a = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), _mm512_castsi512_ps(_mm512_slli_epi32(wide, 16)), a);
+  }
+  float s = _mm512_reduce_add_ps(a);
+  return s + avx2::dot_bf16<DIM - B>(q + B, x + B);
+}
+
+template <size_t DIM>
+KERNELS_AVX512 inline float dot_i8f(const float *q, const int8_t *x) {
+  constexpr size_t B = DIM / 16 * 16;
+  __m512 a = _mm512_setzero_ps();
+  for (size_t i = 0; i < B; i += 16) {
+    __m512 xv = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(x + i))));
+    a = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), xv, a);
+  }
+  float s = _mm512_reduce_add_ps(a);
+  return s + avx2::dot_i8f<DIM - B>(q + B, x + B);
+}
+
+template <size_t DIM>
+KERNELS_AVX512 inline float dot_i8f_scaled(const float *q, const float *scale, const int8_t *x) {
+  constexpr size_t B = DIM / 16 * 16;
+  __m512 a = _mm512_setzero_ps();
+  for (size_t i = 0; i < B; i += 16) {
+    __m512 xv = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(x + i))));
+    a = _mm512_fmadd_ps(_mm512_mul_ps(_mm512_loadu_ps(q + i), _mm512_loadu_ps(scale + i)), xv, a);
+  }
+  float s = _mm512_reduce_add_ps(a);
+  return s + avx2::dot_i8f_scaled<DIM - B>(q + B, scale + B, x + B);
+}
+
+template <size_t DIM>
+KERNELS_AVX512 inline int32_t dot_i8(const int8_t *q, const int8_t *x) {
+  constexpr size_t B = DIM / 32 * 32;
+  __m512i a = _mm512_setzero_si512();
+  for (size_t i = 0; i < B; i += 32) {
+    __m512i qv = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(q + i)));
+    __m512i xv = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(x + i)));
+    a = _mm512_add_epi32(a, _mm512_madd_epi16(qv, xv));
+  }
+  return _mm512_reduce_add_epi32(a) + avx2::dot_i8<DIM - B>(q + B, x + B);
+}
+
+} // namespace avx512
+#pragma GCC diagnostic pop
+#endif // KERNELS_X86
+
+// Dispatchers: what Words, the trees and the scans call.
+#ifdef KERNELS_X86
+#define KERNELS_DISPATCH(name, sse2_version, ...) \
+  switch (active_level) { \
+    case SimdLevel::AVX512: return avx512::name<DIM>(__VA_ARGS__); \
+    case SimdLevel::AVX2: return avx2::name<DIM>(__VA_ARGS__); \
+    case SimdLevel::SSE2: return sse2_version<DIM>(__VA_ARGS__); \
+    default: return scalar::name<DIM>(__VA_ARGS__); \
+  }
+#else
+#define KERNELS_DISPATCH(name, sse2_version, ...) return scalar::name<DIM>(__VA_ARGS__);
+#endif
+
+template <size_t DIM>
+inline float dot_f32(const float *q, const float *x) {
+  KERNELS_DISPATCH(dot_f32, sse2::dot_f32, q, x)
+}
+
+template <size_t DIM>
+inline float dot_f16(const float *q, const uint16_t *x) {
+  KERNELS_DISPATCH(dot_f16, scalar::dot_f16, q, x)
+}
+
+template <size_t DIM>
+inline float dot_bf16(const float *q, const uint16_t *x) {
+  KERNELS_DISPATCH(dot_bf16, scalar::dot_bf16, q, x)
+}
+
+template <size_t DIM>
+inline float dot_i8f(const float *q, const int8_t *x) {
+  KERNELS_DISPATCH(dot_i8f, scalar::dot_i8f, q, x)
+}
+
+template <size_t DIM>
+inline float dot_i8f_scaled(const float *q, const float *scale, const int8_t *x) {
+  KERNELS_DISPATCH(dot_i8f_scaled, scalar::dot_i8f_scaled, q, scale, x)
+}
+
+template <size_t DIM>
+inline int32_t dot_i8(const int8_t *q, const int8_t *x) {
+  KERNELS_DISPATCH(dot_i8, scalar::dot_i8, q, x)
+}
+
+#undef KERNELS_DISPATCH
+
+/* Blocked one-to-many and many-to-many fp32 kernels, for leaf scans and brute force.
+   Scoring rows one dot product at a time reloads the query for every row, and each row's sum is one serial
+   chain of FMAs, so the loop waits on FMA latency instead of filling the FMA units. Like the inner kernel of a
+   small GEMM (https://en.wikipedia.org/wiki/Matrix_multiplication_algorithm#Communication-avoiding_and_distributed_algorithms):
+    1. One-to-many: the query is loaded into registers once. ROWS rows are scored together, so each loaded
+       query vector feeds ROWS independent accumulators and the FMAs of different rows overlap.
+    2. Many-to-many: a batch of up to QBLOCK queries is scored against one row at a time, so each row vector
+       is loaded once and reused for every query in the batch.
+   row(i) returns the fp32 row of the i-th item, so contiguous ranges and id lists share the kernels. */
+constexpr size_t ROWS = 4;
+constexpr size_t QBLOCK = 4;
+
+namespace scalar {
+
+template <size_t DIM, typename RowFn>
+inline void dot_many_f32(const float *q, RowFn row, size_t n, float *out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = dot_f32<DIM>(q, row(i));
+  }
+}
+
+template <size_t DIM, typename RowFn>
+inline void dot_batch_f32(const float *const *qs, size_t nq, RowFn row, size_t n, float *out) {
+  for (size_t j = 0; j < nq; j++) {
+    for (size_t i = 0; i < n; i++) {
+      out[j * n + i] = dot_f32<DIM>(qs[j], row(i));
+    }
+  }
+}
+
+} // namespace scalar
+
+#ifdef KERNELS_X86
+namespace avx2 {
+
+// (1) DIM / 8 query registers, ROWS accumulators; the DIM % 8 tail is scalar.
+template <size_t DIM, typename RowFn>
+KERNELS_AVX2 inline void dot_many_f32(const float *q, RowFn row, size_t n, float *out) {
+  constexpr size_t V = DIM / 8;
+  __m256 qv[V > 0 ? V : 1];
+  for (size_t v = 0; v < V; v++) {
+    qv[v] = _mm256_loadu_ps(q + 8 * v);
+  }
+  size_t i = 0;
+  for (; i + ROWS <= n; i += ROWS) {
+    const float *x[ROWS];
+    __m256 a[ROWS];
+    for (size_t r = 0; r < ROWS; r++) {
+      x[r] = row(i + r);
+      a[r] = _mm256_setzero_ps();
+    }
+    for (size_t v = 0; v < V; v++) {
+      for (size_t r = 0; r < ROWS; r++) {
+        a[r] = _mm256_fmadd_ps(qv[v], _mm256_loadu_ps(x[r] + 8 * v), a[r]);
+      }
+    }
+    for (size_t r = 0; r < ROWS; r++) {
+      float s = hsum256(a[r]);
+      for (size_t d = 8 * V; d < DIM; d++) {
+        s += q[d] * x[r][d];
+      }
+      out[i + r] = s;
+    }
+  }
+  for (; i < n; i++) {
+    out[i] = dot_f32<DIM>(q, row(i));
+  }
+}
+
+// (2)
+template <size_t DIM, typename RowFn>
+KERNELS_AVX2 inline void dot_batch_f32(const float *const *qs, size_t nq, RowFn row, size_t n, float *out) {
+  constexpr size_t V = DIM / 8;
+  for (size_t j0 = 0; j0 < nq; j0 += QBLOCK) {
+    const size_t nb = min(QBLOCK, nq - j0);
+    if (nb < QBLOCK) { // Partial batch: one query at a time
+      for (size_t j = j0; j < nq; j++) {
+        dot_many_f32<DIM>(qs[j], row, n, out + j * n);
+      }
+      return;
+    }
+    for (size_t i = 0; i < n; i++) {
+      const float *x = row(i);
+      __m256 a[QBLOCK];
+      for (size_t j = 0; j < QBLOCK; j++) {
+        a[j] = _mm256_setzero_ps();
+      }
+      for (size_t v = 0; v < V; v++) {
+        const __m256 xv = _mm256_loadu_ps(x + 8 * v);
+        for (size_t j = 0; j < QBLOCK; j++) {
+          a[j] = _mm256_fmadd_ps(_mm256_loadu_ps(qs[j0 + j] + 8 * v), xv, a[j]);
+        }
+      }
+      for (size_t j = 0; j < QBLOCK; j++) {
+        float s = hsum256(a[j]);
+        for (size_t d = 8 * V; d < DIM; d++) {
+          s += qs[j0 + j][d] * x[d];
+        }
+        out[(j0 + j) * n + i] = s;
+      }
+    }
+  }
+}
+
+} // namespace avx2
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized" // See above
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+namespace avx512 {
+
+// (1) DIM / 16 query registers plus a masked tail register, ROWS accumulators.
+template <size_t DIM, typename RowFn>
+KERNELS_AVX512 inline void dot_many_f32(const float *q, RowFn row, size_t n, float *out) {
+  constexpr size_t V = DIM / 16;
+  constexpr size_t T = DIM - 16 * V;
+  const __mmask16 m = (__mmask16)((1u << T) - 1);
+  __m512 qv[V + 1];
+  for (size_t v = 0; v < V; v++) {
+    qv[v] = _mm512_loadu_ps(q + 16 * v);
+  }
+  qv[V] = _mm512_maskz_loadu_ps(m, q + 16 * V);
+  size_t i = 0;
+  for (; i + ROWS <= n; i += ROWS) {
+    const float *x[ROWS];
+    __m512 a[ROWS];
+    for (size_t r = 0; r < ROWS; r++) {
+      x[r] = row(i + r);
+      a[r] = _mm512_setzero_ps();
+    }
+    for (size_t v = 0; v < V; v++) {
+      for (size_t r = 0; r < ROWS; r++) {
+        a[r] = _mm512_fmadd_ps(qv[v], _mm512_loadu_ps(x[r] + 16 * v), a[r]);
+      }
+    }
+    if constexpr (T > 0) {
+      for (size_t r = 0; r < ROWS; r++) {
+        a[r] = _mm512_fmadd_ps(qv[V], _mm512_maskz_loadu_ps(m, x[r] + 16 * V), a[r]);
+      }
+    }
+    for (size_t r = 0; r < ROWS; r++) {
+      out[i + r] = _mm512_reduce_add_ps(a[r]);
+    }
+  }
+  for (; i < n; i++) {
+    out[i] = dot_f32<DIM>(q, row(i));
+  }
+}
+
+// (2)
+template <size_t DIM, typename RowFn>
+KERNELS_AVX512 inline void dot_batch_f32(const float *const *qs, size_t nq, RowFn row, size_t n, float *out) {
+  constexpr size_t V = DIM / 16;
+  constexpr size_t T = DIM - 16 * V;
+  const __mmask16 m = (__mmask16)((1u << T) - 1);
+  for (size_t j0 = 0; j0 < nq; j0 += QBLOCK) {
+    if (nq - j0 < QBLOCK) { // Partial batch: one query at a time
+      for (size_t j = j0; j < nq; j++) {
+        dot_many_f32<DIM>(qs[j], row, n, out + j * n);
+      }
+      return;
+    }
+    for (size_t i = 0; i < n; i++) {
+      const float *x = row(i);
+      __m512 a[QBLOCK];
+      for (size_t j = 0; j < QBLOCK; j++) {
+        a[j] = _mm512_setzero_ps();
+      }
+      for (size_t v = 0; v < V; v++) {
+        const __m512 xv = _mm512_loadu_ps(x + 16 * v);
+        for (size_t j = 0; j < QBLOCK; j++) {
+          a[j] = _mm512_fmadd_ps(_mm512_loadu_ps(qs[j0 + j] + 16 * v), xv, a[j]);
+        }
+      }
+      if constexpr (T > 0) {
+        const __m512 xv = _mm512_maskz_loadu_ps(m, x + 16 * V);
+        for (size_t j = 0; j < QBLOCK; j++) {
+          a[j] = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, qs[j0 + j] + 16 * V), xv, a[j]);
+        }
+      }
+      for (size_t j = 0; j < QBLOCK; j++) {
+        out[(j0 + j) * n + i] = _mm512_reduce_add_ps(a[j]);
+      }
+    }
+  }
+}
+
+} // namespace avx512
+#pragma GCC diagnostic pop
+#endif // KERNELS_X86
+
+// out[i] = q . row(i) for i < n
+template <size_t DIM, typename RowFn>
+inline void dot_many_f32(const float *q, RowFn row, size_t n, float *out) {
+#ifdef KERNELS_X86
+  switch (active_level) {
+    case SimdLevel::AVX512: return avx512::dot_many_f32<DIM>(q, row, n, out);
+    case SimdLevel::AVX2: return avx2::dot_many_f32<DIM>(q, row, n, out);
+    default: break;
+  }
+#endif
+  scalar::dot_many_f32<DIM>(q, row, n, out);
+}
+
+// out[j * n + i] = qs[j] . row(i) for j < nq, i < n
+template <size_t DIM, typename RowFn>
+inline void dot_batch_f32(const float *const *qs, size_t nq, RowFn row, size_t n, float *out) {
+#ifdef KERNELS_X86
+  switch (active_level) {
+    case SimdLevel::AVX512: return avx512::dot_batch_f32<DIM>(qs, nq, row, n, out);
+    case SimdLevel::AVX2: return avx2::dot_batch_f32<DIM>(qs, nq, row, n, out);
+    default: break;
+  }
+#endif
+  scalar::dot_batch_f32<DIM>(qs, nq, row, n, out);
+}
+
+} // namespace kernels
+
+#endif //KERNELS_H
@@ -0,0 +1,86 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+#include <iostream>
+#include <string>
+#include <cstddef>
+#include <fcntl.h>    // open, referenced from https://man7.org/linux/man-pages/man2/open.2.html
+#include <sys/mman.h> // mmap/munmap/madvise, referenced from https://man7.org/linux/man-pages/man2/mmap.2.html
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // close
+using namespace std;
+
+// Read-only memory mapping of a whole file. The bytes stay owned by the OS page cache, so parsing
+// straight out of data() avoids the copies that getline/istringstream make.
+class MappedFile {
+  private:
+    const char *ptr = nullptr;
+    size_t length = 0;
+  public:
+    MappedFile() = default;
+    ~MappedFile() {close();}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    // Moving hands the mapping over, so a file can be checked before it replaces another one.
+    MappedFile(MappedFile&& other) noexcept : ptr(other.ptr), length(other.length) {other.ptr = nullptr; other.length = 0;}
+    MappedFile& operator=(MappedFile&& other) noexcept {
+      if (this != &other) {
+        close();
+        ptr = other.ptr;
+        length = other.length;
+        other.ptr = nullptr;
+        other.length = 0;
+      }
+      return *this;
+    }
+
+    // advice is passed to madvise, e.g. MADV_SEQUENTIAL for one front-to-back parse.
+    bool open(const string& fileName, int advice = MADV_SEQUENTIAL);
+    void close();
+    // madvise on the first length bytes (the whole file if length is 0).
+    void advise(int advice, size_t length = 0) const;
+
+    const char *data() const {return ptr;}
+    size_t size() const {return length;}
+    bool isOpen() const {return ptr != nullptr;}
+};
+
+bool MappedFile::open(const string& fileName, int advice) {
+  close();
+  int fd = ::open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "Error opening file " << fileName << endl;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    cerr << "Error reading size of file " << fileName << endl;
+    ::close(fd);
+    return false;
+  }
+  void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd); // The mapping keeps its own reference to the file.
+  if (m == MAP_FAILED) {
+    cerr << "Error mapping file " << fileName << endl;
+    return false;
+  }
+  madvise(m, st.st_size, advice);
+  ptr = static_cast<const char*>(m);
+  length = st.st_size;
+  return true;
+}
+
+void MappedFile::advise(int advice, size_t length) const {
+  if (ptr != nullptr) {
+    madvise(const_cast<char*>(ptr), (length == 0 || length > this->length) ? this->length : length, advice);
+  }
+}
+
+void MappedFile::close() {
+  if (ptr != nullptr) {
+    munmap(const_cast<char*>(ptr), length);
+  }
+  ptr = nullptr;
+  length = 0;
+}
+
+#endif //MAPPEDFILE_H
@@ -0,0 +1,148 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include "Words.h"
+#include "Parallel.h"
+using namespace std;
+
+/* Distance policies for the trees and the brute-force index. The metric is a template parameter, so the inner
+   loops have no virtual call or branch on it. The SIMD kernels only compute dot products, so each policy turns
+   q . x and the squared norms |q|^2, |x|^2 into its distance:
+    - CosineMetric: rows and queries are unit vectors (Words normalizes them on load). distance = 1 - q . x.
+      Cosine distance is not a metric, so ball radii and pruning bounds use the angle acos(q . x) instead, which
+      is (it is the great-circle distance on the unit sphere).
+    - L2Metric: rows as they are in the file. distance = |q - x| = sqrt(|q|^2 + |x|^2 - 2 q . x).
+    - InnerProductMetric: maximum inner product search, reduced to L2 search by norm augmentation, referenced
+      from "Speeding Up the Xbox Recommender System Using a Euclidean Transformation for Inner-Product Spaces"
+      (Bachrach et al., RecSys 2014, section 3). Every row x becomes x' = (x, sqrt(M^2 - |x|^2)) with
+      M = max |x|, and the query becomes q' = (q, 0). Then |q' - x'|^2 = |q|^2 + M^2 - 2 q . x, so the nearest x'
+      is the row with the largest q . x. Because |q' - x'| is a true metric, the ball and splitting-plane bounds
+      of the trees hold as they are. The extra coordinate is kept per row in RowNorms, not in the matrix.
+*/
+// Bound on the rounding error of a float dot product of two unit vectors: a sum of DIM products is off by at most
+// about DIM * epsilon / 2 * sum |q_i x_i| <= DIM * epsilon / 2 (Cauchy-Schwarz), referenced from "Accuracy and
+// Stability of Numerical Algorithms" (Higham, 2002, section 3.1). Taken for DIM = 1024 to cover every word file.
+const float COSINE_DOT_ERROR = 1024 * numeric_limits<float>::epsilon() / 2;
+
+struct CosineMetric {
+  static constexpr const char *name = "cosine";
+  static constexpr bool normalized = true; // Rows, queries and ball centers are unit vectors
+  static constexpr bool augmented = false;
+  // Distance between q and x from q . x and the squared norms (|x'|^2 = M^2 for augmented rows). Smaller is closer.
+  static float distance(float dot, float, float) {return 1 - dot;}
+  // Radius stored for a ball whose farthest point is at distance max_distance from its center: the angle.
+  // The radius and lowerBound take the dot products as COSINE_DOT_ERROR off, so the pruning is exact. That slack
+  // comes from the error itself rather than a fixed angle: acos is steep near 0, so it widens a ball of nearly
+  // parallel vectors by up to sqrt(2 * COSINE_DOT_ERROR) ~ 0.01 radians, but a ball of radius R only by about
+  // COSINE_DOT_ERROR / sin(R), 1e-4 radians or less at the radii of word vector balls.
+  static float ballRadius(float max_distance) {return angle(max_distance + COSINE_DOT_ERROR);}
+  // Smallest distance allowed to a point within radius (ballRadius) of a center that is at distance d from q.
+  // By the triangle inequality for angles, such a point is at least max(0, angle(d) - radius) away from q,
+  // referenced from https://en.wikipedia.org/wiki/Great-circle_distance (the central angle is a metric). This is
+  // the exact distance to the ball's spherical cap, so it never skips a ball that holds a nearer point.
+  static float lowerBound(float d, float radius) {
+    const float a = angle(max(0.0f, d - COSINE_DOT_ERROR));
+    return a <= radius ? 0 : 1 - cos(a - radius) - COSINE_DOT_ERROR;
+  }
+  // Angle between unit vectors at cosine distance d.
+  static float angle(float d) {return acos(min(1.0f, max(-1.0f, 1 - d)));}
+  // Squared Euclidean distance from q to a row with similarity s (below), for the KD tree's splitting plane test.
+  // m2 is the augmentation constant M^2. For unit vectors |q - x|^2 = 2 (1 - cos(q, x)), referenced from
+  // https://en.wikipedia.org/wiki/Cosine_similarity ("L2-normalized Euclidean distance").
+  static float euclidean2(float s, float, float) {return 2 - 2 * s;}
+  // What the searches report for x, larger is closer: the cosine.
+  static float similarity(float dot, float, float) {return dot;}
+  // The q . x at which a row reaches similarity s / distance d. Early abandoning drops rows that cannot exceed it.
+  static float dotForSimilarity(float s, float, float) {return s;}
+  static float dotForDistance(float d, float, float) {return 1 - d;}
+};
+
+struct L2Metric {
+  static constexpr const char *name = "l2";
+  static constexpr bool normalized = false;
+  static constexpr bool augmented = false;
+  static float distance(float dot, float qq, float xx) {return sqrt(max(0.0f, qq + xx - 2 * dot));}
+  static float ballRadius(float max_distance) {return max_distance;}
+  static float lowerBound(float d, float radius) {return d - radius;} // Triangle inequality
+  static float euclidean2(float s, float, float) {return s * s;}
+  // -|q - x|
+  static float similarity(float dot, float qq, float xx) {return -distance(dot, qq, xx);}
+  static float dotForSimilarity(float s, float qq, float xx) {return (qq + xx - s * s) / 2;}
+  static float dotForDistance(float d, float qq, float xx) {return (qq + xx - d * d) / 2;}
+};
+
+struct InnerProductMetric {
+  static constexpr const char *name = "ip";
+  static constexpr bool normalized = false;
+  static constexpr bool augmented = true;
+  // |q' - x'|, with xx = M^2 for a row
+  static float distance(float dot, float qq, float xx) {return sqrt(max(0.0f, qq + xx - 2 * dot));}
+  static float ballRadius(float max_distance) {return max_distance;}
+  static float lowerBound(float d, float radius) {return d - radius;}
+  static float euclidean2(float s, float qq, float m2) {return qq + m2 - 2 * s;}
+  // q . x
+  static float similarity(float dot, float, float) {return dot;}
+  static float dotForSimilarity(float s, float, float) {return s;}
+  static float dotForDistance(float d, float qq, float xx) {return (qq + xx - d * d) / 2;}
+};
+
+// Per-row values a metric needs besides the dot product: the squared norm its distance uses (|x|^2, or M^2
+// for an augmented row) and the extra coordinate sqrt(M^2 - |x|^2) of the augmented row. Nothing is stored
+// for cosine, whose rows all have norm 1.
+template <size_t DIM, typename Metric>
+class RowNorms {
+  private:
+    vector<float> norm2;
+    vector<float> extras;
+    float max_norm2 = 1;
+  public:
+    void compute(const Words<DIM>& words, unsigned threads = defaultThreadCount());
+
+    float squaredNorm(size_t id) const {
+      if constexpr (Metric::normalized) return 1;
+      else if constexpr (Metric::augmented) return max_norm2;
+      else return norm2[id];
+    }
+    float extra(size_t id) const {
+      if constexpr (Metric::augmented) return extras[id];
+      else return 0;
+    }
+    // M^2, the squared norm of every augmented row.
+    float augmentation() const {return max_norm2;}
+    size_t memoryBytes() const {return (norm2.capacity() + extras.capacity()) * sizeof(float);}
+};
+
+template <size_t DIM, typename Metric>
+void RowNorms<DIM, Metric>::compute(const Words<DIM>& words, unsigned threads) {
+  norm2.clear();
+  extras.clear();
+  max_norm2 = 1;
+  if constexpr (!Metric::normalized) {
+    const size_t n = words.size();
+    norm2.resize(n);
+    runThreads(threads, [&](unsigned t) {
+      float decoded[DIM];
+      for (size_t i = n * t / threads; i < n * (t + 1) / threads; i++) {
+        // Exact norms from the fp32 rows whenever they are still around (e.g. kept for reranking int8 storage)
+        const float *x = words.hasF32() ? words.row(i) : decoded;
+        if (!words.hasF32()) {
+          words.decode(i, decoded);
+        }
+        norm2[i] = kernels::dot_f32<DIM>(x, x);
+      }
+    });
+    if constexpr (Metric::augmented) {
+      max_norm2 = n > 0 ? *max_element(norm2.begin(), norm2.end()) : 0;
+      extras.resize(n);
+      for (size_t i = 0; i < n; i++) {
+        extras[i] = sqrt(max(0.0f, max_norm2 - norm2[i]));
+      }
+      norm2 = vector<float>(); // Every augmented row has squared norm max_norm2
+    }
+  }
+}
+
+#endif //METRICS_H
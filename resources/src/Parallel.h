@@ -0,0 +1,177 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+#include <thread> // Referenced from https://en.cppreference.com/w/cpp/thread/thread
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+using namespace std;
+
+// Number of worker threads to use when the caller does not say.
+inline unsigned defaultThreadCount() {
+  return max(1u, thread::hardware_concurrency());
+}
+
+// Runs f(0), f(1), ..., f(n-1) on n threads and waits for all of them. f(0) runs on the calling thread.
+template <typename F>
+void runThreads(unsigned n, F&& f) {
+  vector<thread> workers;
+  workers.reserve(n > 0 ? n - 1 : 0);
+  for (unsigned t = 1; t < n; t++) {
+    workers.emplace_back([&f, t]() {f(t);});
+  }
+  if (n > 0) {
+    f(0u);
+  }
+  for (thread& w : workers) {
+    w.join();
+  }
+}
+
+/* Fork-join task pool with one task deque per thread, referenced from "Scheduling Multithreaded Computations by
+   Work Stealing" (Blumofe and Leiserson, JACM 1999):
+    1. fork pushes a task on the bottom of the calling thread's deque.
+    2. A thread looking for work pops the bottom of its own deque (the newest task, whose data is still in its
+       cache) or, if that is empty, steals the top of another thread's deque (the oldest task, usually the biggest).
+    3. join(group) does not block while tasks of group are unfinished: the joining thread runs queued tasks
+       itself, so tasks can fork and join their own subtasks without deadlocking the pool.
+   The deques are guarded by a mutex each. Tasks here are coarse (a subtree or a chunk of thousands of rows), so
+   the locking does not show up next to the work.
+*/
+class WorkStealingPool {
+  public:
+    // Counts the tasks forked into it that have not finished yet.
+    struct TaskGroup {
+      atomic<size_t> pending{0};
+    };
+
+    // threads - 1 workers are started; the thread that creates the pool is the last one, and works while it joins.
+    explicit WorkStealingPool(unsigned threads) {
+      threads = max(1u, threads);
+      for (unsigned i = 0; i < threads; i++) {
+        deques.push_back(make_unique<TaskDeque>());
+      }
+      for (unsigned i = 1; i < threads; i++) {
+        workers.emplace_back([this, i]() {work(i);});
+      }
+    }
+    ~WorkStealingPool() {
+      {
+        lock_guard<mutex> lock(idle_mutex);
+        stopping = true;
+      }
+      idle.notify_all();
+      for (thread& w : workers) {
+        w.join();
+      }
+    }
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    unsigned size() const {return (unsigned)deques.size();}
+
+    // (1) Queues task as part of group. Call join(group) before anything the task uses goes out of scope.
+    void fork(TaskGroup& group, function<void()> task) {
+      group.pending.fetch_add(1, memory_order_relaxed);
+      {
+        TaskDeque& d = *deques[self()];
+        lock_guard<mutex> lock(d.m);
+        d.tasks.push_back(Task{move(task), &group});
+      }
+      queued.fetch_add(1, memory_order_release);
+      {
+        lock_guard<mutex> lock(idle_mutex);
+      }
+      idle.notify_one();
+    }
+    // (3) Returns once every task forked into group has finished.
+    void join(TaskGroup& group) {
+      const unsigned me = self();
+      while (group.pending.load(memory_order_acquire) > 0) {
+        if (!runOne(me)) {
+          this_thread::yield();
+        }
+      }
+    }
+    // Runs f(0), f(1), ..., f(n-1) as tasks and waits for all of them. f(0) runs on the calling thread.
+    template <typename F>
+    void parallelFor(size_t n, F&& f) {
+      TaskGroup group;
+      for (size_t i = 1; i < n; i++) {
+        fork(group, [&f, i]() {f(i);});
+      }
+      if (n > 0) {
+        f((size_t)0);
+      }
+      join(group);
+    }
+
+  private:
+    struct Task {
+      function<void()> run;
+      TaskGroup *group;
+    };
+    struct TaskDeque {
+      mutex m;
+      deque<Task> tasks;
+    };
+    vector<unique_ptr<TaskDeque>> deques; // deques[0] belongs to the thread that created the pool
+    vector<thread> workers;
+    atomic<size_t> queued{0}; // Tasks in any deque
+    mutex idle_mutex;
+    condition_variable idle;
+    bool stopping = false;
+    // Which pool and deque the current thread works for, so fork and join find their own deque.
+    static inline thread_local const WorkStealingPool *current_pool = nullptr;
+    static inline thread_local unsigned current_index = 0;
+
+    unsigned self() const {return current_pool == this ? current_index : 0;}
+
+    // (2) Runs one queued task, if there is any. Returns whether it did.
+    bool runOne(unsigned me) {
+      Task task;
+      bool found = false;
+      for (unsigned k = 0; k < deques.size() && !found; k++) {
+        TaskDeque& d = *deques[(me + k) % deques.size()];
+        lock_guard<mutex> lock(d.m);
+        if (!d.tasks.empty()) {
+          if (k == 0) {
+            task = move(d.tasks.back());
+            d.tasks.pop_back();
+          }
+          else {
+            task = move(d.tasks.front());
+            d.tasks.pop_front();
+          }
+          found = true;
+        }
+      }
+      if (!found) {
+        return false;
+      }
+      queued.fetch_sub(1, memory_order_relaxed);
+      task.run();
+      task.group->pending.fetch_sub(1, memory_order_release);
+      return true;
+    }
+    void work(unsigned index) {
+      current_pool = this;
+      current_index = index;
+      while (true) {
+        if (runOne(index)) {
+          continue;
+        }
+        unique_lock<mutex> lock(idle_mutex);
+        idle.wait(lock, [&]() {return stopping || queued.load(memory_order_acquire) > 0;});
+        if (stopping) {
+          return;
+        }
+      }
+    }
+};
+
+#endif //PARALLEL_H
@@ -0,0 +1,221 @@
+#ifndef WORDINDEX_H
+#define WORDINDEX_H
+#include <iostream>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+using namespace std;
+
+/* Minimal perfect hash from word -> id, so lookups are O(1) with no allocation and no string scans.
+   Hash-and-displace construction, referenced from "Hash, displace, and compress" (Belazzougui, Botelho,
+   Dietzfelbinger 2009) and https://en.wikipedia.org/wiki/Perfect_hash_function:
+    1. Hash every key once (64-bit, seeded). The high bits choose one of about n/3 buckets.
+    2. Place buckets largest first into n slots. For each bucket, search a displacement d such that
+       mix(h + d) lands every key of the bucket in a distinct free slot, and store d for the bucket.
+    3. Buckets with one key skip the search and store their (free) slot directly, flagged by the top bit.
+       This guarantees the last keys always find a home, so every slot ends up used (minimal).
+    4. slots[s] holds the id of the key placed in slot s. A lookup recomputes the slot and compares the
+       word stored for that id, so words that are not in the vocabulary are rejected.
+   The tables are plain uint32 arrays, so they can be written to and used straight out of a snapshot.
+*/
+class WordIndex {
+  private:
+    uint64_t seed = 0;
+    uint32_t bucket_count = 0;
+    uint32_t slot_count = 0;
+    const uint32_t *displacements = nullptr; // bucket_count entries
+    const uint32_t *slots = nullptr;         // slot_count entries, slot -> id
+    vector<uint32_t> owned_displacements;
+    vector<uint32_t> owned_slots;
+
+    static const uint32_t DIRECT = 0x80000000u;
+
+    // splitmix64 finalizer, referenced from https://prng.di.unimi.it/splitmix64.c
+    static uint64_t mix(uint64_t x) {
+      x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+      x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+      return x ^ (x >> 31);
+    }
+    // Maps a 32-bit hash onto [0, n) without a division, referenced from
+    // https://lemire.me/blog/2016/06/27/a-fast-alternative-to-the-modulo-reduction/
+    static uint32_t reduce(uint32_t h, uint32_t n) {return (uint32_t)(((uint64_t)h * n) >> 32);}
+    uint32_t bucketOf(uint64_t h) const {return reduce((uint32_t)(h >> 32), bucket_count);}
+    static uint32_t slotOf(uint64_t h, uint32_t d, uint32_t n) {return reduce((uint32_t)mix(h + d * 0x9e3779b97f4a7c15ull), n);}
+
+    template <typename KeyFn>
+    bool tryBuild(size_t n, const vector<uint64_t>& hashes, KeyFn key);
+  public:
+    WordIndex() = default;
+    // The table pointers may refer to the owned vectors, whose buffers survive a move but not a copy.
+    WordIndex(const WordIndex&) = delete;
+    WordIndex& operator=(const WordIndex&) = delete;
+    WordIndex(WordIndex&&) = default;
+    WordIndex& operator=(WordIndex&&) = default;
+
+    static uint64_t hash(string_view w, uint64_t seed) {
+      uint64_t h = 14695981039346656037ull ^ seed; // FNV-1a, then mixed
+      for (unsigned char c : w) {
+        h = (h ^ c) * 1099511628211ull;
+      }
+      return mix(h);
+    }
+
+    // Builds the index over ids 0..n-1, where key(id) returns the word of id. If a word appears more than
+    // once, the first (most frequent) id wins.
+    template <typename KeyFn>
+    void build(size_t n, KeyFn key);
+
+    // Uses tables that live elsewhere (e.g. in a mapped snapshot). They must outlive the index.
+    void attach(uint64_t seed, uint32_t bucket_count, uint32_t slot_count, const uint32_t *displacements, const uint32_t *slots);
+
+    // Returns the id of w, or -1 if w is not one of the keys.
+    template <typename KeyFn>
+    int find(string_view w, KeyFn key) const;
+
+    uint64_t getSeed() const {return seed;}
+    uint32_t getBucketCount() const {return bucket_count;}
+    uint32_t getSlotCount() const {return slot_count;}
+    const uint32_t *getDisplacements() const {return displacements;}
+    const uint32_t *getSlots() const {return slots;}
+    size_t memoryBytes() const {return ((size_t)bucket_count + slot_count) * sizeof(uint32_t);}
+};
+
+template <typename KeyFn>
+void WordIndex::build(size_t n, KeyFn key) {
+  for (uint64_t s = 1; ; s++) {
+    seed = mix(s);
+    vector<uint64_t> hashes(n);
+    for (size_t i = 0; i < n; i++) {
+      hashes[i] = hash(key(i), seed);
+    }
+    if (tryBuild(n, hashes, key)) {
+      return;
+    }
+  }
+}
+
+template <typename KeyFn>
+bool WordIndex::tryBuild(size_t n, const vector<uint64_t>& hashes, KeyFn key) {
+  bucket_count = (uint32_t)max<size_t>(1, n / 3);
+
+  // (1) Group ids by bucket (counting sort), keeping ids in increasing order within a bucket.
+  vector<uint32_t> bucket_start(bucket_count + 1, 0);
+  for (size_t i = 0; i < n; i++) {
+    bucket_start[bucketOf(hashes[i]) + 1]++;
+  }
+  for (uint32_t b = 0; b < bucket_count; b++) {
+    bucket_start[b + 1] += bucket_start[b];
+  }
+  vector<uint32_t> members(n);
+  vector<uint32_t> fill(bucket_start.begin(), bucket_start.end() - 1);
+  for (size_t i = 0; i < n; i++) {
+    members[fill[bucketOf(hashes[i])]++] = (uint32_t)i;
+  }
+
+  // Drop repeated words: same hash and same text as an earlier id in the bucket.
+  vector<uint32_t> bucket_size(bucket_count);
+  size_t unique = 0;
+  for (uint32_t b = 0; b < bucket_count; b++) {
+    uint32_t *m = members.data() + bucket_start[b];
+    uint32_t size = 0;
+    for (uint32_t j = 0; j < bucket_start[b + 1] - bucket_start[b]; j++) {
+      bool repeated = false;
+      for (uint32_t i = 0; i < size; i++) {
+        if (hashes[m[i]] == hashes[m[j]] && key(m[i]) == key(m[j])) {
+          repeated = true;
+          break;
+        }
+      }
+      if (!repeated) {
+        m[size++] = m[j];
+      }
+    }
+    bucket_size[b] = size;
+    unique += size;
+  }
+  slot_count = (uint32_t)unique;
+
+  // (2) Largest buckets first.
+  vector<uint32_t> order(bucket_count);
+  for (uint32_t b = 0; b < bucket_count; b++) {
+    order[b] = b;
+  }
+  stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {return bucket_size[a] > bucket_size[b];});
+
+  owned_displacements.assign(bucket_count, 0);
+  owned_slots.assign(slot_count, 0);
+  vector<bool> taken(slot_count, false);
+  vector<uint32_t> placed;
+  uint32_t next_free = 0;
+  for (uint32_t b : order) {
+    const uint32_t size = bucket_size[b];
+    const uint32_t *m = members.data() + bucket_start[b];
+    if (size == 0) {
+      break;
+    }
+    // (3)
+    if (size == 1) {
+      while (taken[next_free]) {
+        next_free++;
+      }
+      taken[next_free] = true;
+      owned_slots[next_free] = m[0];
+      owned_displacements[b] = DIRECT | next_free;
+      continue;
+    }
+    bool ok = false;
+    for (uint32_t d = 0; d < (1u << 20) && !ok; d++) {
+      placed.clear();
+      ok = true;
+      for (uint32_t j = 0; j < size; j++) {
+        uint32_t s = slotOf(hashes[m[j]], d, slot_count);
+        if (taken[s] || std::find(placed.begin(), placed.end(), s) != placed.end()) {
+          ok = false;
+          break;
+        }
+        placed.push_back(s);
+      }
+      if (ok) {
+        for (uint32_t j = 0; j < size; j++) {
+          taken[placed[j]] = true;
+          owned_slots[placed[j]] = m[j];
+        }
+        owned_displacements[b] = d;
+      }
+    }
+    if (!ok) {
+      return false; // Retry with another seed
+    }
+  }
+  displacements = owned_displacements.data();
+  slots = owned_slots.data();
+  return true;
+}
+
+void WordIndex::attach(uint64_t seed, uint32_t bucket_count, uint32_t slot_count, const uint32_t *displacements, const uint32_t *slots) {
+  owned_displacements.clear();
+  owned_slots.clear();
+  this->seed = seed;
+  this->bucket_count = bucket_count;
+  this->slot_count = slot_count;
+  this->displacements = displacements;
+  this->slots = slots;
+}
+
+template <typename KeyFn>
+int WordIndex::find(string_view w, KeyFn key) const {
+  if (slot_count == 0) {
+    return -1;
+  }
+  const uint64_t h = hash(w, seed);
+  const uint32_t d = displacements[bucketOf(h)];
+  const uint32_t s = (d & DIRECT) ? (d & ~DIRECT) : slotOf(h, d, slot_count);
+  if (s >= slot_count) {
+    return -1;
+  }
+  const uint32_t id = slots[s];
+  return key(id) == w ? (int)id : -1;
+}
+
+#endif //WORDINDEX_H
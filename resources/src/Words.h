@@ -2,125 +2,1516 @@
 #define WORDS_H
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <fstream>
 #include <sstream> // For istringstream, referenced from https://cplusplus.com/reference/sstream/istringstream/str
 #include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <charconv> // For from_chars, referenced from https://en.cppreference.com/w/cpp/utility/from_chars
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include "MappedFile.h"
+#include "Parallel.h"
+#include "WordIndex.h"
+#include "Kernels.h"
+#include "Basis.h"
 using namespace std;
 
-// Single word object.
+// A query quantized to int8 for Words::dotQuantized. For per-dimension scales the scales are folded into the
+// query before rounding, so both modes reduce to one integer dot product and one multiply.
+template <size_t DIM>
+struct QuantizedQuery {
+  int8_t q[DIM];
+  float scale = 0;
+};
+
+const size_t ABANDON_STEP = 16; // Dimensions summed between two early-abandoning checks (one AVX-512 register)
+
+// A query prepared for Words::dotAbandon: rest[c] is the norm of q past the (c+1)-th step of ABANDON_STEP dimensions.
+template <size_t DIM>
+struct AbandonQuery {
+  static constexpr size_t CHECKS = (DIM - 1) / ABANDON_STEP;
+  const float *q = nullptr;
+  float rest[CHECKS > 0 ? CHECKS : 1];
+};
+
+// Candidates scored by early-abandoning scans and the dimensions they summed, see Words::dotAbandon.
+struct AbandonStats {
+  uint64_t candidates = 0;
+  uint64_t dims = 0;
+  double dimsPerCandidate() const {return candidates > 0 ? (double)dims / candidates : 0;}
+};
+
+// Single word object. This is a lightweight view into Words: copying it copies an id and two pointers,
+// never the string or the floats. DIM is the embedding dimension (50, 100, 300, ...), fixed at compile
+// time so every loop over a vector has a constant trip count the compiler can unroll and vectorize.
+template <size_t DIM>
 struct WordVector {
-  string word = "";
-  void setWord(string word) {this->word = word;}
-  string getWord() const {return this->word;}
-
-  // Float vector of dimension 100. Initializes it as a dimension 100 vector of 0's.
-  vector<float> vec = vector<float>(100);
-  void setVec(vector<float> vec) {this->vec = vec;}
-  vector<float> getVec() const {return this->vec;}
+  int id = -1; // Row in the Words matrix, -1 if this does not refer to a word
+  string_view word = "";
+  string getWord() const {return string(this->word);}
+
+  // Normalized float vector of dimension DIM, pointing into the Words fp32 matrix. nullptr when Words keeps
+  // reduced-precision storage only; use Words::dot / Words::decode with id instead.
+  const float *vec = nullptr;
+};
+
+// How Words keeps the normalized vectors in memory.
+enum class Storage {
+  F32,  // 4 bytes per value
+  F16,  // IEEE half, 2 bytes per value, widened inside the dot-product kernels
+  BF16, // bfloat16, 2 bytes per value, widened inside the dot-product kernels
+  INT8, // 1 byte per value, one scale per vector
+  INT8_DIM // 1 byte per value, one scale per dimension
+};
+
+inline string storageName(Storage s) {
+  switch (s) {
+    case Storage::F16: return "fp16";
+    case Storage::BF16: return "bf16";
+    case Storage::INT8: return "int8";
+    case Storage::INT8_DIM: return "int8-dim";
+    default: return "fp32";
+  }
+}
+
+inline bool isQuantized(Storage s) {return s == Storage::INT8 || s == Storage::INT8_DIM;}
+
+// Parses "fp32" / "fp16" / "bf16" / "int8" / "int8-dim". Returns false for anything else.
+inline bool parseStorage(const string& name, Storage& out) {
+  for (Storage s : {Storage::F32, Storage::F16, Storage::BF16, Storage::INT8, Storage::INT8_DIM}) {
+    if (name == storageName(s)) {
+      out = s;
+      return true;
+    }
+  }
+  return false;
+}
+
+// On-disk formats Words::load understands.
+enum class WordFormat {
+  GloVe,         // "word v_1 ... v_DIM" per line
+  FastText,      // .vec: a "count dim" header line, then GloVe-style lines
+  Word2VecBinary, // "count dim\n" header, then per word: "word " followed by DIM raw float32 values
+  Snapshot       // Our own binary snapshot (see SnapshotHeader)
+};
+
+inline string formatName(WordFormat f) {
+  switch (f) {
+    case WordFormat::FastText: return "fastText .vec";
+    case WordFormat::Word2VecBinary: return "word2vec binary";
+    case WordFormat::Snapshot: return "snapshot";
+    default: return "GloVe text";
+  }
+}
+
+// Throughput of the last load, so we can check the parser runs close to memory bandwidth.
+struct LoadStats {
+  size_t bytes = 0;
+  size_t lines = 0;
+  unsigned threads = 1;
+  double seconds = 0;
+  WordFormat format = WordFormat::GloVe;
+
+  double megabytesPerSecond() const {return seconds > 0 ? (bytes / 1e6) / seconds : 0;}
+  double linesPerSecond() const {return seconds > 0 ? lines / seconds : 0;}
+  void print() const;
+};
+
+// Word lookups since loading, split by where the word was found.
+struct LookupStats {
+  size_t indexed = 0;      // In the loaded top N words (matrix, trees and word index)
+  size_t tail = 0;         // Fetched from the rest of the file through the tail offset table
+  size_t missing = 0;      // In neither
+  size_t tail_words = 0;   // Words in the tail offset table, 0 until the first tail lookup builds it
+  double tail_seconds = 0; // Time spent in tail lookups, including building the offset table
+  void print() const;
 };
 
-// Loads words and vectors from the GloVe txt file.
+void LookupStats::print() const {
+  cout << "Lookups: " << indexed << " indexed, " << tail << " from the tail (" << tail_words << " tail words, "
+       << 1000 * tail_seconds << " ms in tail lookups), " << missing << " not found" << endl;
+}
+
+void LoadStats::print() const {
+  cout << "Parsed " << bytes / 1e6 << " MB (" << lines << " lines, " << formatName(format) << ") on " << threads << " thread(s) in " << seconds << " seconds: "
+       << megabytesPerSecond() << " MB/s, " << linesPerSecond() << " lines/s" << endl;
+}
+
+/* Binary snapshot of an already normalized vocabulary, so a process start is an mmap instead of a parse.
+   File layout (all offsets are from the start of the file, native byte order):
+    [SnapshotHeader][pad to 64][float matrix, count x dim, row-major][uint64 offsets, count + 1][word bytes]
+    [pad to 8][uint32 index displacements, index_buckets][uint32 index slots, index_slots]   (version 2+)
+    Word i is the bytes [offsets[i], offsets[i+1]) of the string table. The index section is the WordIndex
+    tables, so lookups work straight from the mapping. Version 1 files have no index; it is rebuilt on load.
+*/
+struct SnapshotHeader {
+  char magic[8];           // "WVSNAP\0\0"
+  uint32_t version;
+  uint32_t byte_order;     // 0x01020304 as written, to reject files from a different-endian machine
+  uint64_t count;          // Number of words
+  uint32_t dim;            // Floats per word
+  uint32_t flags;          // Bit 0: vectors are unit-normalized
+  uint64_t matrix_offset;  // 64-byte aligned
+  uint64_t offsets_offset;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+  uint64_t checksum;       // FNV-1a over the matrix and the string table, identifies the data set
+  // Version 2
+  uint64_t index_seed;
+  uint64_t index_offset;   // 0 if the file has no index
+  uint32_t index_buckets;
+  uint32_t index_slots;
+};
+
+const char SNAPSHOT_MAGIC[8] = {'W', 'V', 'S', 'N', 'A', 'P', 0, 0};
+const uint32_t SNAPSHOT_VERSION = 2;
+const uint32_t SNAPSHOT_MIN_VERSION = 1; // Oldest version loadSnapshot still reads
+const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+const uint32_t SNAPSHOT_NORMALIZED = 1;
+
+// FNV-1a hash, referenced from https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
+inline uint64_t fnv1a(const void *data, size_t size, uint64_t h = 14695981039346656037ull) {
+  const unsigned char *p = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < size; i++) {
+    h = (h ^ p[i]) * 1099511628211ull;
+  }
+  return h;
+}
+
+// 64-byte aligned buffer (one cache line, and the widest SIMD load), referenced from
+// https://en.cppreference.com/w/cpp/memory/c/aligned_alloc
+struct AlignedFree {
+  void operator()(void *p) const {free(p);}
+};
+template <typename T>
+using AlignedBuffer = unique_ptr<T[], AlignedFree>;
+using AlignedFloats = AlignedBuffer<float>;
+
+template <typename T = float>
+inline AlignedBuffer<T> allocateAligned(size_t count) {
+  size_t bytes = (count * sizeof(T) + 63) / 64 * 64;
+  T *p = static_cast<T*>(aligned_alloc(64, max<size_t>(bytes, 64)));
+  if (p == nullptr) {
+    throw bad_alloc();
+  }
+  return AlignedBuffer<T>(p);
+}
+
+// What detectFormat learned from the start of a file.
+struct FormatInfo {
+  WordFormat format = WordFormat::GloVe;
+  size_t dim = 0;         // 0 if it could not be determined
+  size_t count = 0;       // Words announced by the header (fastText, word2vec, snapshot), 0 for GloVe
+  size_t data_offset = 0; // First byte after the header line
+};
+
+/* Tells the formats apart from the first bytes of a file:
+    1. The snapshot magic identifies a snapshot.
+    2. A first line of exactly two unsigned integers is a "count dim" header (fastText and word2vec).
+       Anything else is GloVe text, whose dimension is the number of tokens on the first line minus the word.
+    3. After a header, the first record is fastText text if everything between the word and the next
+       newline is DIM numbers. Raw float32 bytes are practically never all digits, signs, dots and spaces.
+*/
+inline FormatInfo detectFormat(const char *data, size_t size) {
+  FormatInfo info;
+  // (1)
+  if (size >= sizeof(SnapshotHeader) && memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0) {
+    SnapshotHeader header;
+    memcpy(&header, data, sizeof(header));
+    info.format = WordFormat::Snapshot;
+    info.dim = header.dim;
+    info.count = header.count;
+    return info;
+  }
+  // (2)
+  const char *end = data + size;
+  const char *nl = static_cast<const char*>(memchr(data, '\n', size));
+  const char *line_end = (nl == nullptr) ? end : nl;
+  vector<string_view> tokens;
+  for (const char *p = data; p < line_end; ) {
+    while (p < line_end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+      p++;
+    }
+    const char *t = p;
+    while (p < line_end && *p != ' ' && *p != '\t' && *p != '\r') {
+      p++;
+    }
+    if (p > t) {
+      tokens.push_back(string_view(t, p - t));
+    }
+  }
+  auto parseCount = [](string_view t, size_t& out) {
+    auto [next, ec] = from_chars(t.data(), t.data() + t.size(), out);
+    return ec == errc() && next == t.data() + t.size();
+  };
+  if (tokens.size() != 2 || !parseCount(tokens[0], info.count) || !parseCount(tokens[1], info.dim)) {
+    info.count = 0;
+    info.dim = tokens.empty() ? 0 : tokens.size() - 1;
+    return info;
+  }
+  info.data_offset = (nl == nullptr) ? size : nl - data + 1;
+
+  // (3)
+  const char *p = data + info.data_offset;
+  const char *word_end = static_cast<const char*>(memchr(p, ' ', end - p));
+  info.format = WordFormat::Word2VecBinary;
+  if (word_end == nullptr) {
+    info.format = WordFormat::FastText; // No records to look at; the text reader handles an empty body
+    return info;
+  }
+  size_t numbers = 0;
+  bool in_number = false;
+  for (const char *q = word_end; q < end && *q != '\n'; q++) {
+    const char c = *q;
+    if (c == ' ' || c == '\r') {
+      in_number = false;
+    }
+    else if ((c >= '0' && c <= '9') || c == '.' || c == '-' || c == '+' || c == 'e' || c == 'E') {
+      numbers += in_number ? 0 : 1;
+      in_number = true;
+    }
+    else {
+      return info; // A byte that cannot be text: word2vec binary
+    }
+  }
+  if (numbers == info.dim) {
+    info.format = WordFormat::FastText;
+  }
+  return info;
+}
+
+// detectFormat on the start of a file. 1 MB holds the header and the first record of any realistic dimension.
+inline FormatInfo detectFormat(string fileName) {
+  ifstream in(fileName, ios::binary);
+  if (!in.is_open()) {
+    cerr << "Error opening file " << fileName << endl;
+    return FormatInfo();
+  }
+  string head(1 << 20, '\0');
+  in.read(&head[0], head.size());
+  head.resize(in.gcount());
+  return detectFormat(head.data(), head.size());
+}
+
+// Reads the vector dimension of a word file without loading it, in any format detectFormat knows.
+// Returns 0 if the file cannot be read.
+inline size_t detectDimension(string fileName) {
+  return detectFormat(fileName).dim;
+}
+
+/* Loads words and vectors from the GloVe txt file (or a snapshot of it).
+   Storage is one 64-byte aligned row-major count x DIM float matrix, plus every word packed into a
+   single string table indexed by offsets. Either both live in memory owned by Words (text loads), or they
+   point straight into the mapped snapshot file.
+   setStorage(F16 / BF16) swaps the fp32 matrix for a 16-bit copy of the same layout, halving memory and
+   memory bandwidth. Code that reads rows should go through dot / decode / value, which work in every mode.
+   setStorage(INT8 / INT8_DIM) scans a 1-byte copy instead and keeps the fp32 rows (in place in a mapped
+   snapshot) only to rerank the final shortlist exactly, see rerank().
+*/
+template <size_t DIM>
 class Words {
   private:
-    vector<WordVector> words;
+    size_t count = 0;
+    const float *matrix = nullptr;    // count x DIM, row i is word i
+    const uint64_t *offsets = nullptr; // count + 1 entries into strings
+    const char *strings = nullptr;
+    LoadStats stats;
+    WordIndex index; // word -> id
+
+    // Backing storage for text loads
+    AlignedFloats owned_matrix;
+    size_t owned_capacity = 0; // Rows allocated in owned_matrix
+    vector<uint64_t> owned_offsets;
+    string owned_strings;
+    // Backing storage for snapshot loads
+    MappedFile mapping;
+    // Words after the first `limit` of a text file loaded with one. The file stays mapped; the tail offset table
+    // (line starts relative to tail_begin) and its word index are built by the first tail lookup.
+    MappedFile text_file;
+    const char *tail_begin = nullptr;
+    const char *tail_end = nullptr;
+    mutable vector<uint64_t> tail_lines;
+    mutable WordIndex tail_index;
+    mutable bool tail_paged = false;
+    mutable LookupStats lookups;
+    void pageTail() const;
+    string_view tailWord(size_t i) const;
+    // Reduced-precision rows, count x DIM, when storage is F16 or BF16
+    Storage storage = Storage::F32;
+    AlignedBuffer<uint16_t> half_matrix;
+    // Quantized rows, count x DIM, when storage is INT8 (count scales) or INT8_DIM (DIM scales)
+    AlignedBuffer<int8_t> int8_matrix;
+    vector<float> int8_scales;
+    void quantize(Storage s);
+    // Rows rotated by setBasis: basis_matrix is the DIM x DIM rotation, rest_norms[id * CHECKS + c] the norm of
+    // row id past its (c+1)-th ABANDON_STEP dimensions.
+    Basis basis = Basis::Original;
+    vector<float> basis_matrix;
+    vector<float> rest_norms;
+    mutable atomic<uint64_t> abandon_candidates{0};
+    mutable atomic<uint64_t> abandon_dims{0};
+    // dotAbandon given partial = q . x over the first FIRST dimensions.
+    template <size_t FIRST>
+    float dotAbandonFrom(const AbandonQuery<DIM>& q, const float *x, const float *x_rest, float partial, float min_dot, size_t& dims) const;
+
+    void clear();
+    void reserveRows(size_t rows);
+    void adoptOwned(); // Points matrix/offsets/strings at the owned buffers
+    void buildIndex();
+    float *mutableRow(size_t id) {return owned_matrix.get() + id * DIM;}
+
+    // Parses one "word v_1 ... v_DIM" line in place, writing the floats into out. Returns false if the line is malformed.
+    static bool parseLine(const char *begin, const char *end, string_view& word, float *out);
+    // Number of lines in [begin, end), counting a last line without '\n'.
+    static size_t countLines(const char *begin, const char *end);
+    // Parses and normalizes every line in [begin, end) into consecutive rows starting at out, appending the words
+    // to chunk_strings and their end offsets to chunk_ends. Returns the number of rows written.
+    // Rows of the chunk that were zero vectors go to chunk_zeros (relative to out).
+    size_t parseChunk(const char *begin, const char *end, float *out, string& chunk_strings, vector<uint64_t>& chunk_ends,
+                             vector<uint32_t>& chunk_zeros);
+    // Scales v to unit length. Returns false for a zero vector, which is left as it is.
+    static bool normalizeVector(float *v);
+    static bool isZeroVector(const float *v);
+    // What the loaders do with each parsed row: normalizeVector, or only the zero check when the rows are kept
+    // as they are. Returns false for a zero vector.
+    bool finishRow(float *v) const {return normalize_rows ? normalizeVector(v) : !isZeroVector(v);}
+    bool normalize_rows = true;
+    // Ids of the zero vectors, ascending. Known after a text or word2vec load; found by a scan for snapshots.
+    mutable vector<uint32_t> zero_ids;
+    mutable bool zero_ids_known = false;
+    // dataChecksum, from the snapshot header or computed on first use (and before setBasis / setStorage change the rows).
+    mutable uint64_t data_checksum = 0;
+    mutable bool data_checksum_known = false;
   public:
+    Words() = default;
+    Words(const Words&) = delete;
+    Words& operator=(const Words&) = delete;
+
     void loadWords(string fileName);
+    // mmap + from_chars loader, split across threads at line boundaries. No per-line copies.
+    // Also reads fastText .vec files, whose "count dim" header line is skipped.
+    // With limit > 0 only the first limit words are loaded; the rest are reachable through fetchTail.
+    void loadWordsMapped(string fileName, unsigned threads = defaultThreadCount(), size_t limit = 0);
+    // mmap loader for word2vec's binary format: the floats are copied, not parsed.
+    void loadWord2VecBinary(string fileName, unsigned threads = defaultThreadCount());
+    // Writes the loaded (normalized) vocabulary as a binary snapshot. Returns false on I/O errors.
+    bool saveSnapshot(string fileName) const;
+    // Reopens a snapshot written by saveSnapshot. The matrix and strings are used in place from the mapping.
+    bool loadSnapshot(string fileName);
+    // Loads a snapshot, GloVe text, fastText .vec or word2vec binary file, whichever fileName is.
+    // limit > 0 keeps only the first (most frequent) limit words of a text file, see fetchTail.
+    void load(string fileName, size_t limit = 0);
+    // Whether loaders scale rows to unit length (the default, for cosine). The L2 and inner-product metrics
+    // need the vectors as they are in the file; call setNormalize(false) before loading for those.
+    void setNormalize(bool on) {normalize_rows = on;}
+    bool isNormalized() const {return normalize_rows;}
+    const LoadStats& getLoadStats() const {return stats;}
+    // Renormalizes every fp32 row in parallel. Loaders already normalize each row as it is parsed, so this is
+    // only needed after rows were changed in place.
     void normalizeWords(); // For cosine similarity computation
-    WordVector findWord(string w);
-    const vector<WordVector>& getWords() {return words;}
+    // Words whose vector is all zeros. They cannot be normalized and have cosine 0 with every query.
+    const vector<uint32_t>& zeroVectors() const;
+    WordVector<DIM> findWord(string_view w) const;
+    // Id of w in O(1) through the word index, or -1 if w is not in the vocabulary.
+    int findId(string_view w) const {
+      int id = index.find(w, [this](size_t id) {return word(id);});
+      lookups.indexed += (id >= 0);
+      return id;
+    }
+    // For words past the load limit: writes the normalized vector of w to out and returns true if w is in
+    // the rest of the file. Such words are not in the matrix or the trees, but can be used as queries.
+    bool fetchTail(string_view w, float *out) const;
+    bool hasTail() const {return tail_begin != nullptr;}
+    const LookupStats& getLookupStats() const {return lookups;}
+
+    // Converts the stored vectors to another format (F32 only works while fp32 rows are still available).
+    // A mapped snapshot keeps its fp32 rows on disk. An owned fp32 matrix is freed for F16 / BF16, and kept
+    // for INT8 / INT8_DIM so the shortlist can be reranked.
+    bool setStorage(Storage s);
+    Storage getStorage() const {return storage;}
+    // True when searches run on approximate rows but exact fp32 rows are still around to rerank with.
+    bool canRerank() const {return storage != Storage::F32 && hasF32();}
+    // Rescores candidates by exact fp32 cosine with q and returns the best k as (id, cosine), best first.
+    vector<pair<int,float>> rerank(const float *q, const vector<int>& candidates, size_t k) const {
+      return rerank(q, candidates, k, [](int, float dot) {return dot;});
+    }
+    // Same, ranking by score(id, q . row(id)) instead, e.g. -|q - x| for L2. Returns (id, score) pairs.
+    template <typename ScoreFn>
+    vector<pair<int,float>> rerank(const float *q, const vector<int>& candidates, size_t k, ScoreFn score) const;
+
+    // Rotates every fp32 row onto basis b (see Basis.h), so the leading dimensions carry most of each row's
+    // length, and records the per-row norms early abandoning needs. Vectors fetched later (tail words) are
+    // rotated the same way. Dot products are unchanged. Needs fp32 storage; a mapped matrix is copied.
+    bool setBasis(Basis b);
+    Basis getBasis() const {return basis;}
+    // True when scans can use dotAbandon: rows in a variance-ordered basis and fp32 storage.
+    bool canAbandon() const {return basis != Basis::Original && storage == Storage::F32;}
+    void prepareAbandon(const float *q, AbandonQuery<DIM>& out) const;
+    // q . row(id), summed ABANDON_STEP dimensions at a time. After each step, if the partial sum plus the
+    // Cauchy-Schwarz bound |q_rest| |x_rest| on the remaining dimensions cannot exceed min_dot, gives up and
+    // returns -infinity. Adds the dimensions summed to dims.
+    float dotAbandon(const AbandonQuery<DIM>& q, size_t id, float min_dot, size_t& dims) const {
+      return dotAbandonFrom<0>(q, row(id), rest_norms.data() + id * AbandonQuery<DIM>::CHECKS, 0.0f, min_dot, dims);
+    }
+    // dotAbandon for the n rows id(0..n-1), with min_dot(i) the threshold of row i, into out. The first
+    // ABANDON_STEP dimensions of every row go through the register-blocked kernel, so only the rows that
+    // survive the first check are scored one at a time.
+    template <typename IdFn, typename MinDotFn>
+    void dotAbandonMany(const AbandonQuery<DIM>& q, IdFn id, size_t n, MinDotFn min_dot, float *out, size_t& dims) const;
+    // Totals for getAbandonStats; scans add their counts once per call.
+    void countAbandon(uint64_t candidates, uint64_t dims) const {
+      abandon_candidates.fetch_add(candidates, memory_order_relaxed);
+      abandon_dims.fetch_add(dims, memory_order_relaxed);
+    }
+    AbandonStats getAbandonStats() const {return {abandon_candidates.load(), abandon_dims.load()};}
+    void resetAbandonStats() const {abandon_candidates = 0; abandon_dims = 0;}
+
+    // Accessors. Ids are rows of the matrix, in file order.
+    size_t size() const {return count;}
+    // fp32 row, only while hasF32() (nullptr otherwise).
+    const float *row(size_t id) const {return matrix ? matrix + id * DIM : nullptr;}
+    bool hasF32() const {return matrix != nullptr;}
+    string_view word(size_t id) const {return string_view(strings + offsets[id], offsets[id + 1] - offsets[id]);}
+    WordVector<DIM> operator[](size_t id) const {return WordVector<DIM>{(int)id, word(id), row(id)};}
+    bool isMapped() const {return mapping.isOpen();}
+    // FNV-1a over the fp32 rows in the file's basis and the string table, the value saveSnapshot records, so it
+    // identifies the data set. Read from the header for a snapshot; a pass over the rows otherwise.
+    uint64_t dataChecksum() const;
+    // dataChecksum chained with the rotation of setBasis and the storage format: identifies the rows as dot and
+    // decode return them, which is what an index built on them depends on (BallTree::saveIndex).
+    uint64_t checksum() const;
+
+    // Row access that works for every storage format:
+    // q . row(id), widening reduced-precision rows inside the kernel.
+    float dot(const float *q, size_t id) const;
+    // out[i] = q . row(id(i)) for i < n, where id(i) is the i-th row id. fp32 rows use the register-blocked
+    // kernels in Kernels.h; the other formats score one row at a time.
+    template <typename IdFn>
+    void dotMany(const float *q, IdFn id, size_t n, float *out) const;
+    // out[j * n + i] = qs[j] . row(first + i) for the nq queries qs and the rows [first, first + n).
+    void dotBatch(const float *const *qs, size_t nq, size_t first, size_t n, float *out) const;
+    // Writes row id as DIM floats into out.
+    void decode(size_t id, float *out) const;
+    // Component axis of row id.
+    float value(size_t id, size_t axis) const;
+    // int8 x int8 scoring for INT8 / INT8_DIM storage: quantizeQuery once per query, then dotQuantized per row.
+    void quantizeQuery(const float *q, QuantizedQuery<DIM>& out) const;
+    float dotQuantized(const QuantizedQuery<DIM>& q, size_t id) const {
+      const float row_scale = storage == Storage::INT8 ? int8_scales[id] : 1.0f;
+      return q.scale * row_scale * kernels::dot_i8<DIM>(q.q, int8_matrix.get() + id * DIM);
+    }
+    // Bytes held for the matrix, offsets, string table and word index.
+    size_t memoryBytes() const;
 
     // For debugging purposes //
     void printWords();
     void printWordsRange(int range);
 };
 
-void Words::normalizeWords() {
-  for (int i = 0; i < words.size(); i++) {
-    // Compute magnitude - ||v|| = sqrt(v_1^2 + v_2^2 + ... + v_n^2)
-    float sum = 0;
-    for (int j = 0; j < words[i].vec.size(); j++) {
-      float num = words[i].vec[j];
-      sum += (num * num);
+template <size_t DIM>
+void Words<DIM>::clear() {
+  count = 0;
+  matrix = nullptr;
+  offsets = nullptr;
+  strings = nullptr;
+  owned_matrix.reset();
+  owned_capacity = 0;
+  owned_offsets.assign(1, 0);
+  owned_strings.clear();
+  mapping.close();
+  index = WordIndex();
+  storage = Storage::F32;
+  half_matrix.reset();
+  int8_matrix.reset();
+  int8_scales.clear();
+  text_file.close();
+  tail_begin = tail_end = nullptr;
+  tail_lines.clear();
+  tail_index = WordIndex();
+  tail_paged = false;
+  lookups = LookupStats();
+  zero_ids.clear();
+  zero_ids_known = true;
+  data_checksum_known = false;
+  basis = Basis::Original;
+  basis_matrix.clear();
+  rest_norms.clear();
+}
+
+template <size_t DIM>
+string_view Words<DIM>::tailWord(size_t i) const {
+  const char *line = tail_begin + tail_lines[i];
+  const char *line_end = (i + 1 < tail_lines.size()) ? tail_begin + tail_lines[i + 1] : tail_end;
+  const char *word_end = static_cast<const char*>(memchr(line, ' ', line_end - line));
+  return string_view(line, (word_end ? word_end : line_end) - line);
+}
+
+/* Lazy tail paging:
+    1. The first tail lookup walks the tail once with memchr and records where every line starts. Only the
+       word bytes are compared later, the floats are left unparsed.
+    2. A word index over the tail words (the same minimal perfect hash as the loaded words) maps a word to
+       its line.
+    3. Each lookup parses just that one line, so a rare word costs one page of the file, not a full load.
+*/
+template <size_t DIM>
+void Words<DIM>::pageTail() const {
+  // (1)
+  tail_paged = true;
+  for (const char *p = tail_begin; p < tail_end; ) {
+    const char *nl = static_cast<const char*>(memchr(p, '\n', tail_end - p));
+    const char *line_end = nl ? nl : tail_end;
+    if (line_end > p && !(line_end - p == 1 && *p == '\r')) {
+      tail_lines.push_back(p - tail_begin);
+    }
+    p = line_end + 1;
+  }
+  // (2)
+  tail_index.build(tail_lines.size(), [this](size_t i) {return tailWord(i);});
+  lookups.tail_words = tail_lines.size();
+}
+
+template <size_t DIM>
+bool Words<DIM>::fetchTail(string_view w, float *out) const {
+  if (!hasTail()) {
+    lookups.missing++;
+    return false;
+  }
+  auto t1 = chrono::steady_clock::now();
+  if (!tail_paged) {
+    pageTail();
+  }
+  // (3)
+  const int i = tail_index.find(w, [this](size_t id) {return tailWord(id);});
+  bool found = false;
+  if (i >= 0) {
+    const char *line = tail_begin + tail_lines[i];
+    const char *line_end = static_cast<const char*>(memchr(line, '\n', tail_end - line));
+    line_end = line_end ? line_end : tail_end;
+    if (line_end > line && line_end[-1] == '\r') {
+      line_end--;
+    }
+    string_view parsed;
+    found = parseLine(line, line_end, parsed, out);
+    if (found && normalize_rows) {
+      normalizeVector(out);
+    }
+    if (found && basis != Basis::Original) {
+      float original[DIM];
+      memcpy(original, out, sizeof(original));
+      for (size_t j = 0; j < DIM; j++) {
+        out[j] = kernels::dot_f32<DIM>(basis_matrix.data() + j * DIM, original);
+      }
+    }
+  }
+  (found ? lookups.tail : lookups.missing)++;
+  lookups.tail_seconds += chrono::duration<double>(chrono::steady_clock::now() - t1).count();
+  return found;
+}
+
+template <size_t DIM>
+bool Words<DIM>::setStorage(Storage s) {
+  if (s == storage) {
+    return true;
+  }
+  if (s == Storage::F32) {
+    if (!hasF32()) {
+      cerr << "Error: fp32 rows were released, reload the words to go back to fp32" << endl;
+      return false;
+    }
+    storage = Storage::F32;
+    half_matrix.reset();
+    int8_matrix.reset();
+    int8_scales.clear();
+    return true;
+  }
+  if (!hasF32()) {
+    cerr << "Error: converting between reduced formats needs the fp32 rows" << endl;
+    return false;
+  }
+  if (isQuantized(s)) {
+    quantize(s);
+    half_matrix.reset();
+    storage = s;
+    return true;
+  }
+  dataChecksum(); // The fp32 rows may be freed below
+  AlignedBuffer<uint16_t> converted = allocateAligned<uint16_t>(count * DIM);
+  const unsigned threads = defaultThreadCount();
+  runThreads(threads, [&](unsigned t) {
+    for (size_t i = count * DIM * t / threads; i < count * DIM * (t + 1) / threads; i++) {
+      converted[i] = (s == Storage::F16) ? kernels::f32_to_f16(matrix[i]) : kernels::f32_to_bf16(matrix[i]);
+    }
+  });
+  half_matrix = move(converted);
+  int8_matrix.reset();
+  int8_scales.clear();
+  storage = s;
+  if (!isMapped()) {
+    owned_matrix.reset();
+    owned_capacity = 0;
+    matrix = nullptr;
+  }
+  return true;
+}
+
+/* Symmetric scalar quantization, referenced from https://arxiv.org/abs/1712.05877 (Jacob et al., section 2):
+    1. Pick a scale per vector (INT8) or per dimension (INT8_DIM): s = max|x| / 127 over that group.
+    2. Store round(x / s) as int8, so x ~ s * x8 with an error of at most s / 2 per value.
+   Per-dimension scales suit GloVe, where a few dimensions have much larger range than the rest. */
+template <size_t DIM>
+void Words<DIM>::quantize(Storage s) {
+  vector<float> scales(s == Storage::INT8 ? count : DIM, 0.0f);
+  if (s == Storage::INT8_DIM) {
+    for (size_t i = 0; i < count; i++) {
+      for (size_t j = 0; j < DIM; j++) {
+        scales[j] = max(scales[j], fabs(matrix[i * DIM + j]));
+      }
+    }
+    for (float& sc : scales) {
+      sc = sc > 0 ? sc / 127.0f : 1.0f;
+    }
+  }
+  AlignedBuffer<int8_t> converted = allocateAligned<int8_t>(count * DIM);
+  const unsigned threads = defaultThreadCount();
+  runThreads(threads, [&](unsigned t) {
+    for (size_t i = count * t / threads; i < count * (t + 1) / threads; i++) {
+      const float *x = matrix + i * DIM;
+      if (s == Storage::INT8) {
+        float m = 0;
+        for (size_t j = 0; j < DIM; j++) {
+          m = max(m, fabs(x[j]));
+        }
+        scales[i] = m > 0 ? m / 127.0f : 1.0f;
+      }
+      for (size_t j = 0; j < DIM; j++) {
+        const float sc = (s == Storage::INT8) ? scales[i] : scales[j];
+        converted[i * DIM + j] = (int8_t)lrintf(x[j] / sc);
+      }
+    }
+  });
+  int8_matrix = move(converted);
+  int8_scales = move(scales);
+}
+
+template <size_t DIM>
+void Words<DIM>::quantizeQuery(const float *q, QuantizedQuery<DIM>& out) const {
+  float folded[DIM];
+  float m = 0;
+  for (size_t j = 0; j < DIM; j++) {
+    folded[j] = (storage == Storage::INT8_DIM) ? q[j] * int8_scales[j] : q[j];
+    m = max(m, fabs(folded[j]));
+  }
+  out.scale = m > 0 ? m / 127.0f : 1.0f;
+  for (size_t j = 0; j < DIM; j++) {
+    out.q[j] = (int8_t)lrintf(folded[j] / out.scale);
+  }
+}
+
+template <size_t DIM>
+template <typename ScoreFn>
+vector<pair<int,float>> Words<DIM>::rerank(const float *q, const vector<int>& candidates, size_t k, ScoreFn score) const {
+  vector<pair<int,float>> scored;
+  scored.reserve(candidates.size());
+  for (int id : candidates) {
+    scored.push_back({id, score(id, hasF32() ? kernels::dot_f32<DIM>(q, row(id)) : dot(q, id))});
+  }
+  k = min(k, scored.size());
+  partial_sort(scored.begin(), scored.begin() + k, scored.end(),
+               [](const pair<int,float>& a, const pair<int,float>& b) {return a.second > b.second;});
+  scored.resize(k);
+  return scored;
+}
+
+/* Early abandoning, referenced from "Searching and Mining Trillions of Time Series Subsequences under Dynamic Time
+   Warping" (Rakthanmanon et al., KDD 2012, section 4.2) for the idea and https://en.wikipedia.org/wiki/Cauchy–Schwarz_inequality:
+    1. setBasis rotates the rows so the leading dimensions hold most of their length (Basis.h), and stores the
+       norm of each row past every ABANDON_STEP-th dimension.
+    2. A scan passes the smallest dot product that could still enter its top k. dotAbandon sums one step at a
+       time; since the rest of the sum is at most |q_rest| |x_rest|, the row is rejected as soon as
+       partial + |q_rest| |x_rest| cannot reach it. Most rows of a top-k scan are rejected after a step or two.
+*/
+template <size_t DIM>
+bool Words<DIM>::setBasis(Basis b) {
+  if (b == basis) {
+    return true;
+  }
+  if (basis != Basis::Original || storage != Storage::F32 || !hasF32()) {
+    cerr << "Error: the basis can only be set once, on fp32 rows in the file's basis (before --storage)" << endl;
+    return false;
+  }
+  dataChecksum(); // Of the rows in the file's basis, before they are rotated
+  // (1) Rotate out of place, since a snapshot's rows are mapped read-only.
+  const vector<float> B = computeBasis<DIM>(matrix, count, b);
+  AlignedFloats rotated = allocateAligned(count * DIM);
+  constexpr size_t CHECKS = AbandonQuery<DIM>::CHECKS;
+  vector<float> norms(count * CHECKS);
+  const unsigned threads = defaultThreadCount();
+  runThreads(threads, [&](unsigned t) {
+    for (size_t id = count * t / threads; id < count * (t + 1) / threads; id++) {
+      float *out = rotated.get() + id * DIM;
+      for (size_t i = 0; i < DIM; i++) {
+        out[i] = kernels::dot_f32<DIM>(B.data() + i * DIM, matrix + id * DIM);
+      }
+      float rest = 0;
+      for (size_t i = DIM; i-- > ABANDON_STEP; ) {
+        rest += out[i] * out[i];
+        if (i % ABANDON_STEP == 0) {
+          norms[id * CHECKS + i / ABANDON_STEP - 1] = sqrt(rest);
+        }
+      }
+    }
+  });
+  owned_matrix = move(rotated);
+  owned_capacity = count;
+  matrix = owned_matrix.get();
+  rest_norms = move(norms);
+  basis_matrix = B;
+  basis = b;
+  return true;
+}
+
+template <size_t DIM>
+void Words<DIM>::prepareAbandon(const float *q, AbandonQuery<DIM>& out) const {
+  out.q = q;
+  float rest = 0;
+  for (size_t i = DIM; i-- > ABANDON_STEP; ) {
+    rest += q[i] * q[i];
+    if (i % ABANDON_STEP == 0) {
+      out.rest[i / ABANDON_STEP - 1] = sqrt(rest);
+    }
+  }
+}
+
+// (2)
+template <size_t DIM>
+template <size_t FIRST>
+float Words<DIM>::dotAbandonFrom(const AbandonQuery<DIM>& q, const float *x, const float *x_rest, float partial, float min_dot, size_t& dims) const {
+  if constexpr (FIRST >= DIM) {
+    return partial;
+  }
+  else {
+    if constexpr (FIRST > 0) {
+      constexpr size_t c = FIRST / ABANDON_STEP - 1;
+      const float bound = q.rest[c] * x_rest[c];
+      // The slack covers rounding, so a row is only dropped if it is out by more than float error.
+      if (partial + bound + 1e-5f * (fabs(partial) + bound) < min_dot) {
+        return -numeric_limits<float>::infinity();
+      }
+    }
+    constexpr size_t LEN = min(ABANDON_STEP, DIM - FIRST);
+    dims += LEN;
+    return dotAbandonFrom<FIRST + LEN>(q, x, x_rest, partial + kernels::dot_f32<LEN>(q.q + FIRST, x + FIRST), min_dot, dims);
+  }
+}
+
+template <size_t DIM>
+template <typename IdFn, typename MinDotFn>
+void Words<DIM>::dotAbandonMany(const AbandonQuery<DIM>& q, IdFn id, size_t n, MinDotFn min_dot, float *out, size_t& dims) const {
+  constexpr size_t FIRST = min(ABANDON_STEP, DIM);
+  kernels::dot_many_f32<FIRST>(q.q, [&](size_t i) {return row(id(i));}, n, out);
+  dims += n * FIRST;
+  for (size_t i = 0; i < n; i++) {
+    const size_t r = id(i);
+    out[i] = dotAbandonFrom<FIRST>(q, row(r), rest_norms.data() + r * AbandonQuery<DIM>::CHECKS, out[i], min_dot(i), dims);
+  }
+}
+
+template <size_t DIM>
+float Words<DIM>::dot(const float *q, size_t id) const {
+  switch (storage) {
+    case Storage::F16: return kernels::dot_f16<DIM>(q, half_matrix.get() + id * DIM);
+    case Storage::BF16: return kernels::dot_bf16<DIM>(q, half_matrix.get() + id * DIM);
+    case Storage::INT8: return int8_scales[id] * kernels::dot_i8f<DIM>(q, int8_matrix.get() + id * DIM);
+    case Storage::INT8_DIM: return kernels::dot_i8f_scaled<DIM>(q, int8_scales.data(), int8_matrix.get() + id * DIM);
+    default: return kernels::dot_f32<DIM>(q, matrix + id * DIM);
+  }
+}
+
+template <size_t DIM>
+template <typename IdFn>
+void Words<DIM>::dotMany(const float *q, IdFn id, size_t n, float *out) const {
+  if (storage == Storage::F32) {
+    kernels::dot_many_f32<DIM>(q, [&](size_t i) {return matrix + (size_t)id(i) * DIM;}, n, out);
+    return;
+  }
+  for (size_t i = 0; i < n; i++) {
+    out[i] = dot(q, id(i));
+  }
+}
+
+template <size_t DIM>
+void Words<DIM>::dotBatch(const float *const *qs, size_t nq, size_t first, size_t n, float *out) const {
+  if (storage == Storage::F32) {
+    kernels::dot_batch_f32<DIM>(qs, nq, [&](size_t i) {return matrix + (first + i) * DIM;}, n, out);
+    return;
+  }
+  for (size_t j = 0; j < nq; j++) {
+    dotMany(qs[j], [first](size_t i) {return first + i;}, n, out + j * n);
+  }
+}
+
+template <size_t DIM>
+void Words<DIM>::decode(size_t id, float *out) const {
+  for (size_t j = 0; j < DIM; j++) {
+    out[j] = value(id, j);
+  }
+}
+
+template <size_t DIM>
+float Words<DIM>::value(size_t id, size_t axis) const {
+  switch (storage) {
+    case Storage::F16: return kernels::f16_to_f32(half_matrix[id * DIM + axis]);
+    case Storage::BF16: return kernels::bf16_to_f32(half_matrix[id * DIM + axis]);
+    case Storage::INT8: return int8_scales[id] * int8_matrix[id * DIM + axis];
+    case Storage::INT8_DIM: return int8_scales[axis] * int8_matrix[id * DIM + axis];
+    default: return matrix[id * DIM + axis];
+  }
+}
+
+template <size_t DIM>
+void Words<DIM>::reserveRows(size_t rows) {
+  if (rows <= owned_capacity) {
+    return;
+  }
+  AlignedFloats grown = allocateAligned(rows * DIM);
+  if (count > 0) {
+    memcpy(grown.get(), owned_matrix.get(), count * DIM * sizeof(float));
+  }
+  owned_matrix = move(grown);
+  owned_capacity = rows;
+}
+
+template <size_t DIM>
+void Words<DIM>::adoptOwned() {
+  matrix = owned_matrix.get();
+  offsets = owned_offsets.data();
+  strings = owned_strings.data();
+}
+
+template <size_t DIM>
+size_t Words<DIM>::memoryBytes() const {
+  // Rows searched on, plus the fp32 rows INT8 modes keep aside for reranking when they are owned (a mapped
+  // snapshot's rows stay on disk).
+  size_t value_bytes = sizeof(float);
+  if (storage == Storage::F16 || storage == Storage::BF16) {
+    value_bytes = sizeof(uint16_t);
+  }
+  else if (isQuantized(storage)) {
+    value_bytes = sizeof(int8_t);
+  }
+  const size_t rerank_bytes = (storage != Storage::F32 && owned_matrix) ? owned_capacity * DIM * sizeof(float) : 0;
+  return count * DIM * value_bytes + rerank_bytes + (int8_scales.size() + rest_norms.size()) * sizeof(float) + (count + 1) * sizeof(uint64_t)
+         + (count > 0 ? offsets[count] : 0) + index.memoryBytes();
+}
+
+template <size_t DIM>
+void Words<DIM>::buildIndex() {
+  index.build(count, [this](size_t id) {return word(id);});
+}
+
+// v_norm = v / ||v||, where ||v|| = sqrt(v_1^2 + v_2^2 + ... + v_n^2).
+// The sum of squares uses 8 independent partial sums so the compiler can keep them in one SIMD register
+// (a single running sum is a dependency chain it may not reorder), and the scale is one reciprocal
+// followed by multiplies instead of DIM divides.
+template <size_t DIM>
+bool Words<DIM>::normalizeVector(float *v) {
+  constexpr size_t BLOCKED = DIM / 8 * 8;
+  float partial[8] = {};
+  for (size_t i = 0; i < BLOCKED; i += 8) {
+    for (size_t l = 0; l < 8; l++) {
+      partial[l] += v[i + l] * v[i + l];
     }
-    sum = sqrt(sum);
+  }
+  for (size_t i = BLOCKED; i < DIM; i++) {
+    partial[i - BLOCKED] += v[i] * v[i];
+  }
+  float sum = ((partial[0] + partial[4]) + (partial[1] + partial[5])) + ((partial[2] + partial[6]) + (partial[3] + partial[7]));
+  if (sum == 0) {
+    return false;
+  }
+  const float inv = 1.0f / sqrt(sum);
+  for (size_t j = 0; j < DIM; j++) {
+    v[j] *= inv;
+  }
+  return true;
+}
+
+template <size_t DIM>
+bool Words<DIM>::isZeroVector(const float *v) {
+  for (size_t j = 0; j < DIM; j++) {
+    if (v[j] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <size_t DIM>
+void Words<DIM>::normalizeWords() {
+  // Snapshots are stored normalized (and mapped read-only), and reduced rows are only made from normalized ones.
+  if (isMapped() || storage != Storage::F32) {
+    return;
+  }
+  const unsigned threads = defaultThreadCount();
+  vector<vector<uint32_t>> zeros(threads);
+  runThreads(threads, [&](unsigned t) {
+    for (size_t i = count * t / threads; i < count * (t + 1) / threads; i++) {
+      if (!normalizeVector(mutableRow(i))) {
+        zeros[t].push_back((uint32_t)i);
+      }
+    }
+  });
+  zero_ids.clear();
+  for (const vector<uint32_t>& z : zeros) {
+    zero_ids.insert(zero_ids.end(), z.begin(), z.end());
+  }
+  zero_ids_known = true;
+}
 
-    // Normalize each WordVector - v_norm = v / ||v|| = v / sum. If sum = 0, continue.
-    for (int k = 0; k < words[i].vec.size(); k++) {
-      if (sum == 0) {
-        continue;
+template <size_t DIM>
+const vector<uint32_t>& Words<DIM>::zeroVectors() const {
+  if (!zero_ids_known) {
+    // Snapshot: the rows were normalized when it was written, so a zero row is still exactly zero.
+    const unsigned threads = defaultThreadCount();
+    vector<vector<uint32_t>> zeros(threads);
+    runThreads(threads, [&](unsigned t) {
+      for (size_t i = count * t / threads; i < count * (t + 1) / threads; i++) {
+        size_t j = 0;
+        while (j < DIM && value(i, j) == 0) {
+          j++;
+        }
+        if (j == DIM) {
+          zeros[t].push_back((uint32_t)i);
+        }
       }
-      words[i].vec[k] = words[i].vec[k] / sum;
+    });
+    zero_ids.clear();
+    for (const vector<uint32_t>& z : zeros) {
+      zero_ids.insert(zero_ids.end(), z.begin(), z.end());
     }
+    zero_ids_known = true;
   }
+  return zero_ids;
 }
 
 // Referenced https://cplusplus.com/reference/sstream/istringstream/str for istringstream (iss) usage.
-void Words::loadWords(string fileName) {
+template <size_t DIM>
+void Words<DIM>::loadWords(string fileName) {
+  auto t1 = chrono::steady_clock::now();
   ifstream wordstxt;
   wordstxt.open(fileName);
   if (!wordstxt.is_open()) {
     cerr << "Error opening file " << fileName << endl;
     return;
   }
+  clear();
 
   string line;
+  stats = LoadStats();
   while (getline(wordstxt, line)) {
-    WordVector w = WordVector();
+    stats.bytes += line.size() + 1;
+    stats.lines++;
     istringstream iss(line);
 
     // Set word
     string word;
     iss >> word;
-    w.setWord(word);
 
     // Set vector
-    vector<float> vec;
-    float val;
-    for (int i = 0; i < 100; i++){
-      iss >> val;
-      vec.push_back(val);
-    }
-    w.setVec(vec);
-    words.push_back(w);
-    if (words.size() % 100000 == 0) {
+    if (count == owned_capacity) {
+      reserveRows(max<size_t>(1024, count * 2));
+    }
+    float *out = mutableRow(count);
+    for (size_t i = 0; i < DIM; i++){
+      iss >> out[i];
+    }
+    // Normalize now, while the row is in cache, for easy cosine similarity computation cos_sim(u, v) = u_norm (dot) v_norm.
+    if (!finishRow(out)) {
+      zero_ids.push_back((uint32_t)count);
+    }
+    owned_strings += word;
+    owned_offsets.push_back(owned_strings.size());
+    count++;
+    if (count % 100000 == 0) {
       cout << "." << flush; // Read about std::flush here: https://en.cppreference.com/w/cpp/io/manip/flush.html
     }
   }
+  adoptOwned();
+  buildIndex();
+  stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - t1).count();
+}
+
+template <size_t DIM>
+bool Words<DIM>::parseLine(const char *begin, const char *end, string_view& word, float *out) {
+  const char *p = begin;
+  const char *word_end = static_cast<const char*>(memchr(p, ' ', end - p));
+  if (word_end == nullptr) {
+    return false;
+  }
+  word = string_view(p, word_end - p);
+  p = word_end;
 
-  // End by normalizing the word vectors for easy cosine similarity computation cos_sim(u, v) = u_norm (dot) v_norm.
-  normalizeWords();
+  // Parse the floats straight into their row of the matrix.
+  for (size_t i = 0; i < DIM; i++) {
+    while (p < end && *p == ' ') {
+      p++;
+    }
+    auto [next, ec] = from_chars(p, end, out[i]);
+    if (ec != errc()) {
+      return false;
+    }
+    p = next;
+  }
+  // Anything left over means the line has more than DIM numbers (a file of another dimension).
+  while (p < end && *p == ' ') {
+    p++;
+  }
+  return p == end;
 }
 
-// Returns a WordVector of a particular word. If its not found, the first word is returned.
-WordVector Words::findWord(string w) {
-  for (int i = 0; i < words.size(); i++) {
-    if (words[i].word == w) {
-      return words[i];
+template <size_t DIM>
+size_t Words<DIM>::countLines(const char *begin, const char *end) {
+  size_t count = 0;
+  for (const char *q = begin; q < end; q++) {
+    q = static_cast<const char*>(memchr(q, '\n', end - q));
+    count++;
+    if (q == nullptr) {
+      break; // Last line without a trailing newline
     }
   }
+  return count;
+}
+
+template <size_t DIM>
+size_t Words<DIM>::parseChunk(const char *begin, const char *end, float *out, string& chunk_strings, vector<uint64_t>& chunk_ends,
+                              vector<uint32_t>& chunk_zeros) {
+  size_t rows = 0;
+  const char *p = begin;
+  while (p < end) {
+    const char *line_end = static_cast<const char*>(memchr(p, '\n', end - p));
+    if (line_end == nullptr) {
+      line_end = end;
+    }
+    const char *content_end = (line_end > p && line_end[-1] == '\r') ? line_end - 1 : line_end;
+    if (content_end > p) {
+      string_view word;
+      float *row = out + rows * DIM;
+      if (parseLine(p, content_end, word, row)) {
+        if (!finishRow(row)) {
+          chunk_zeros.push_back((uint32_t)rows);
+        }
+        chunk_strings += word;
+        chunk_ends.push_back(chunk_strings.size());
+        rows++;
+      }
+      else {
+        cerr << "Skipping malformed line: " << string(p, min<size_t>(content_end - p, 40)) << endl;
+      }
+    }
+    p = line_end + 1;
+  }
+  return rows;
+}
+
+/* Same result as loadWords, but:
+    1. The file is mmapped instead of streamed through getline, so no line is ever copied. With a limit, only
+       the lines before the limit are loaded; the rest of the mapping is the tail (see pageTail).
+    2. The mapping is cut into one chunk per thread. Each cut is moved forward to the next '\n', so
+       every line belongs to exactly one chunk.
+    3. Each thread counts its lines, so the matrix is allocated once and every chunk knows its first row.
+    4. Each thread parses with from_chars directly into its rows of the matrix and normalizes each row
+       while it is still in cache.
+    5. The per-thread word strings are appended in chunk order, so the word order (GloVe's frequency
+       rank) is exactly the file order. If a chunk skipped malformed lines, later rows are moved down.
+*/
+template <size_t DIM>
+void Words<DIM>::loadWordsMapped(string fileName, unsigned threads, size_t limit) {
+  auto t1 = chrono::steady_clock::now();
+  clear();
+  MappedFile& file = text_file; // Kept open after the load only if there is a tail
+  if (!file.open(fileName)) {
+    return;
+  }
+  const char *begin = file.data();
+  const char *end = begin + file.size();
+  threads = max(1u, threads);
+  const FormatInfo info = detectFormat(begin, file.size());
+  begin += info.data_offset; // fastText header line
+  stats.format = info.format;
+
+  // (1) With a limit, the words after the first limit lines are left in the file as the tail.
+  if (limit > 0) {
+    const char *cut = begin;
+    for (size_t lines = 0; lines < limit && cut < end; lines++) {
+      const char *nl = static_cast<const char*>(memchr(cut, '\n', end - cut));
+      cut = nl ? nl + 1 : end;
+    }
+    if (cut < end) {
+      tail_begin = cut;
+      tail_end = end;
+      end = cut;
+    }
+  }
+
+  // (2)
+  vector<const char*> cuts(threads + 1);
+  cuts[0] = begin;
+  cuts[threads] = end;
+  for (unsigned t = 1; t < threads; t++) {
+    const char *c = max(begin + (end - begin) / threads * t, cuts[t - 1]);
+    const char *nl = static_cast<const char*>(memchr(c, '\n', end - c));
+    cuts[t] = (nl == nullptr) ? end : nl + 1;
+  }
+
+  // (3)
+  vector<size_t> first_row(threads + 1, 0);
+  runThreads(threads, [&](unsigned t) {
+    first_row[t + 1] = countLines(cuts[t], cuts[t + 1]);
+  });
+  for (unsigned t = 0; t < threads; t++) {
+    first_row[t + 1] += first_row[t];
+  }
+  reserveRows(first_row[threads]);
+
+  // (4)
+  vector<size_t> rows(threads);
+  vector<string> chunk_strings(threads);
+  vector<vector<uint64_t>> chunk_ends(threads);
+  vector<vector<uint32_t>> chunk_zeros(threads);
+  runThreads(threads, [&](unsigned t) {
+    chunk_ends[t].reserve(first_row[t + 1] - first_row[t]);
+    rows[t] = parseChunk(cuts[t], cuts[t + 1], mutableRow(first_row[t]), chunk_strings[t], chunk_ends[t], chunk_zeros[t]);
+  });
+
+  // (5)
+  size_t string_bytes = 0;
+  for (const string& s : chunk_strings) {
+    string_bytes += s.size();
+  }
+  owned_strings.reserve(string_bytes);
+  owned_offsets.reserve(first_row[threads] + 1);
+  for (unsigned t = 0; t < threads; t++) {
+    if (count != first_row[t]) {
+      memmove(mutableRow(count), mutableRow(first_row[t]), rows[t] * DIM * sizeof(float));
+    }
+    const uint64_t base = owned_strings.size();
+    owned_strings += chunk_strings[t];
+    for (uint64_t e : chunk_ends[t]) {
+      owned_offsets.push_back(base + e);
+    }
+    for (uint32_t z : chunk_zeros[t]) {
+      zero_ids.push_back((uint32_t)count + z);
+    }
+    count += rows[t];
+  }
+  adoptOwned();
+  buildIndex();
+  auto t2 = chrono::steady_clock::now();
+
+  stats.bytes = end - file.data();
+  stats.lines = first_row[threads];
+  stats.threads = threads;
+  stats.seconds = chrono::duration<double>(t2 - t1).count();
+  if (!hasTail()) {
+    file.close();
+  }
+  else {
+    file.advise(MADV_DONTNEED, tail_begin - file.data()); // The head is parsed, drop its pages
+    file.advise(MADV_RANDOM); // The tail is read a line at a time
+  }
+}
+
+/* word2vec binary, referenced from the reader in https://github.com/tmikolov/word2vec/blob/master/distance.c:
+   "count dim\n", then count records of "word " + dim float32 values, each optionally followed by '\n'.
+    1. One pass finds where each record starts. Words have different lengths, so records cannot be found by
+       arithmetic, but the pass only touches the word bytes (memchr for the space) and skips the floats.
+    2. Each thread memcpys its share of the float blocks into the matrix and normalizes the rows. Nothing
+       is parsed, so this runs at about memcpy speed.
+    3. The words are appended to the string table in file order.
+   The floats are read in native byte order, as word2vec writes them (little-endian on every common machine).
+*/
+template <size_t DIM>
+void Words<DIM>::loadWord2VecBinary(string fileName, unsigned threads) {
+  auto t1 = chrono::steady_clock::now();
+  MappedFile file;
+  if (!file.open(fileName)) {
+    return;
+  }
+  clear();
+  const char *begin = file.data();
+  const char *end = begin + file.size();
+  const FormatInfo info = detectFormat(begin, file.size());
+  if (info.dim != DIM) {
+    cerr << "Error: " << fileName << " has " << info.dim << "-d vectors, expected " << DIM << endl;
+    return;
+  }
+  threads = max(1u, threads);
+  const size_t record_floats = DIM * sizeof(float);
+
+  // (1) The header's count is only trusted as far as the file has room for that many float blocks.
+  const size_t expected = min(info.count, file.size() / record_floats);
+  vector<string_view> words;
+  vector<const char*> floats;
+  words.reserve(expected);
+  floats.reserve(expected);
+  const char *p = begin + info.data_offset;
+  while (words.size() < info.count) {
+    while (p < end && (*p == '\n' || *p == ' ' || *p == '\r')) {
+      p++;
+    }
+    const char *word_end = (p < end) ? static_cast<const char*>(memchr(p, ' ', end - p)) : nullptr;
+    if (word_end == nullptr || (size_t)(end - word_end - 1) < record_floats) {
+      cerr << "Warning: " << fileName << " ends after " << words.size() << " of " << info.count << " words" << endl;
+      break;
+    }
+    words.push_back(string_view(p, word_end - p));
+    floats.push_back(word_end + 1);
+    p = word_end + 1 + record_floats;
+  }
+  reserveRows(words.size());
+  count = words.size();
+
+  // (2)
+  vector<vector<uint32_t>> zeros(threads);
+  runThreads(threads, [&](unsigned t) {
+    for (size_t i = count * t / threads; i < count * (t + 1) / threads; i++) {
+      memcpy(mutableRow(i), floats[i], record_floats);
+      if (!finishRow(mutableRow(i))) {
+        zeros[t].push_back((uint32_t)i);
+      }
+    }
+  });
+  for (const vector<uint32_t>& z : zeros) {
+    zero_ids.insert(zero_ids.end(), z.begin(), z.end());
+  }
+
+  // (3)
+  size_t string_bytes = 0;
+  for (string_view w : words) {
+    string_bytes += w.size();
+  }
+  owned_strings.reserve(string_bytes);
+  owned_offsets.reserve(count + 1);
+  for (string_view w : words) {
+    owned_strings += w;
+    owned_offsets.push_back(owned_strings.size());
+  }
+  adoptOwned();
+  buildIndex();
+
+  stats.bytes = file.size();
+  stats.lines = count;
+  stats.threads = threads;
+  stats.format = WordFormat::Word2VecBinary;
+  stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - t1).count();
+}
+
+template <size_t DIM>
+void Words<DIM>::load(string fileName, size_t limit) {
+  const WordFormat format = detectFormat(fileName).format;
+  if (limit > 0 && (format == WordFormat::Snapshot || format == WordFormat::Word2VecBinary)) {
+    cerr << "Note: a word limit only applies to text files; loading all of " << fileName << endl;
+  }
+  switch (format) {
+    case WordFormat::Snapshot: loadSnapshot(fileName); break;
+    case WordFormat::Word2VecBinary: loadWord2VecBinary(fileName); break;
+    default: loadWordsMapped(fileName, defaultThreadCount(), limit); break; // GloVe and fastText text
+  }
+}
+
+template <size_t DIM>
+bool Words<DIM>::saveSnapshot(string fileName) const {
+  if (!hasF32()) {
+    cerr << "Error: snapshots are written from fp32 rows, save before switching storage" << endl;
+    return false;
+  }
+  SnapshotHeader header = {};
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.byte_order = SNAPSHOT_BYTE_ORDER;
+  header.count = count;
+  header.dim = DIM;
+  header.flags = normalize_rows ? SNAPSHOT_NORMALIZED : 0;
+
+  const uint64_t matrix_bytes = count * DIM * sizeof(float);
+  const uint64_t strings_size = count > 0 ? offsets[count] : 0;
+  header.matrix_offset = (sizeof(SnapshotHeader) + 63) / 64 * 64;
+  header.offsets_offset = header.matrix_offset + matrix_bytes;
+  header.strings_offset = header.offsets_offset + (count + 1) * sizeof(uint64_t);
+  header.strings_size = strings_size;
+  header.checksum = fnv1a(strings, strings_size, fnv1a(matrix, matrix_bytes));
+  header.index_seed = index.getSeed();
+  header.index_buckets = index.getBucketCount();
+  header.index_slots = index.getSlotCount();
+  header.index_offset = (header.strings_offset + strings_size + 7) / 8 * 8;
+
+  ofstream out(fileName, ios::binary | ios::trunc);
+  if (!out.is_open()) {
+    cerr << "Error opening file " << fileName << endl;
+    return false;
+  }
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  const string padding(header.matrix_offset - sizeof(header), '\0');
+  out.write(padding.data(), padding.size());
+  out.write(reinterpret_cast<const char*>(matrix), matrix_bytes);
+  const uint64_t zero = 0;
+  out.write(reinterpret_cast<const char*>(count > 0 ? offsets : &zero), (count + 1) * sizeof(uint64_t));
+  out.write(strings, strings_size);
+  const string index_padding(header.index_offset - header.strings_offset - strings_size, '\0');
+  out.write(index_padding.data(), index_padding.size());
+  out.write(reinterpret_cast<const char*>(index.getDisplacements()), header.index_buckets * sizeof(uint32_t));
+  out.write(reinterpret_cast<const char*>(index.getSlots()), header.index_slots * sizeof(uint32_t));
+  if (!out) {
+    cerr << "Error writing snapshot " << fileName << endl;
+    return false;
+  }
+  return true;
+}
+
+template <size_t DIM>
+uint64_t Words<DIM>::dataChecksum() const {
+  if (!data_checksum_known && hasF32() && basis == Basis::Original) {
+    data_checksum = fnv1a(strings, count > 0 ? offsets[count] : 0, fnv1a(matrix, count * DIM * sizeof(float)));
+    data_checksum_known = true;
+  }
+  return data_checksum;
+}
+
+template <size_t DIM>
+uint64_t Words<DIM>::checksum() const {
+  uint64_t h = dataChecksum();
+  h = fnv1a(basis_matrix.data(), basis_matrix.size() * sizeof(float), h);
+  const uint32_t format = (uint32_t)storage;
+  return fnv1a(&format, sizeof(format), h);
+}
+
+template <size_t DIM>
+bool Words<DIM>::loadSnapshot(string fileName) {
+  auto t1 = chrono::steady_clock::now();
+  clear();
+  zero_ids_known = false; // Rows are already normalized; zeroVectors() scans for zero rows only if asked
+  // Queries touch rows in no particular order, so ask for the whole file up front instead of read-ahead.
+  if (!mapping.open(fileName, MADV_WILLNEED)) {
+    return false;
+  }
+  SnapshotHeader header;
+  if (mapping.size() < sizeof(header)) {
+    cerr << "Error: " << fileName << " is too small to be a snapshot" << endl;
+    mapping.close();
+    return false;
+  }
+  memcpy(&header, mapping.data(), sizeof(header));
+  if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version < SNAPSHOT_MIN_VERSION
+      || header.version > SNAPSHOT_VERSION || header.byte_order != SNAPSHOT_BYTE_ORDER) {
+    cerr << "Error: " << fileName << " is not a version " << SNAPSHOT_VERSION << " snapshot for this machine" << endl;
+    mapping.close();
+    return false;
+  }
+  if (header.dim != DIM || (bool)(header.flags & SNAPSHOT_NORMALIZED) != normalize_rows) {
+    cerr << "Error: " << fileName << " does not hold " << (normalize_rows ? "normalized " : "unnormalized ") << DIM << "-d vectors" << endl;
+    mapping.close();
+    return false;
+  }
+  // Sections in file order, each checked as count <= room / size so a crafted count cannot wrap the product.
+  const uint64_t file_size = mapping.size();
+  if (header.matrix_offset % 64 != 0 || header.matrix_offset > header.offsets_offset
+      || header.offsets_offset > header.strings_offset || header.strings_offset > file_size
+      || header.count > (header.offsets_offset - header.matrix_offset) / (DIM * sizeof(float))
+      || header.count >= (header.strings_offset - header.offsets_offset) / sizeof(uint64_t)
+      || header.strings_size > file_size - header.strings_offset) {
+    cerr << "Error: " << fileName << " is truncated or corrupt" << endl;
+    mapping.close();
+    return false;
+  }
+  const bool has_index = header.version >= 2 && header.index_offset != 0;
+  if (has_index && (header.index_offset % 8 != 0 || header.index_slots > header.count || header.index_offset > file_size
+      || (uint64_t)header.index_buckets + header.index_slots > (file_size - header.index_offset) / sizeof(uint32_t))) {
+    cerr << "Error: " << fileName << " has a truncated or corrupt word index" << endl;
+    mapping.close();
+    return false;
+  }
+  // word() and the index lookups use the offsets and slots as they are, so check them once here: the offsets must
+  // rise to exactly strings_size and every slot must name a word. One pass over both tables, not over the matrix.
+  const uint64_t *file_offsets = reinterpret_cast<const uint64_t*>(mapping.data() + header.offsets_offset);
+  bool tables_ok = header.offsets_offset % 8 == 0 && file_offsets[header.count] == header.strings_size;
+  for (uint64_t i = 0; i < header.count && tables_ok; i++) {
+    tables_ok = file_offsets[i] <= file_offsets[i + 1];
+  }
+  if (has_index) {
+    const uint32_t *file_slots = reinterpret_cast<const uint32_t*>(mapping.data() + header.index_offset) + header.index_buckets;
+    tables_ok = tables_ok && (header.index_buckets > 0 || header.index_slots == 0);
+    for (uint32_t s = 0; s < header.index_slots && tables_ok; s++) {
+      tables_ok = file_slots[s] < header.count;
+    }
+  }
+  if (!tables_ok) {
+    cerr << "Error: " << fileName << " has a corrupt word offset table or word index" << endl;
+    mapping.close();
+    return false;
+  }
+
+  // Zero-copy: the matrix, offsets and strings are used straight out of the mapping (mmap returns
+  // page-aligned memory, so the 64-byte aligned matrix offset keeps rows aligned).
+  count = header.count;
+  matrix = reinterpret_cast<const float*>(mapping.data() + header.matrix_offset);
+  offsets = reinterpret_cast<const uint64_t*>(mapping.data() + header.offsets_offset);
+  strings = mapping.data() + header.strings_offset;
+  data_checksum = header.checksum;
+  data_checksum_known = true;
+  if (has_index) {
+    const uint32_t *tables = reinterpret_cast<const uint32_t*>(mapping.data() + header.index_offset);
+    index.attach(header.index_seed, header.index_buckets, header.index_slots, tables, tables + header.index_buckets);
+  }
+  else {
+    buildIndex();
+  }
+
+  stats.bytes = mapping.size();
+  stats.lines = header.count;
+  stats.threads = 1;
+  stats.format = WordFormat::Snapshot;
+  stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - t1).count();
+  return true;
+}
+
+// Returns a WordVector view of a particular word. If its not found, the returned view has id -1 and an empty word.
+template <size_t DIM>
+WordVector<DIM> Words<DIM>::findWord(string_view w) const {
+  int id = findId(w);
+  if (id >= 0) {
+    return (*this)[id];
+  }
   cout << "Error: Word not found" << endl;
-  return WordVector();
+  return WordVector<DIM>();
 }
 
 // For debugging purposes //
-void Words::printWords() {
-  for (int i = 0; i < words.size(); i++) {
-    cout << "Word: " << words[i].word << endl;
+template <size_t DIM>
+void Words<DIM>::printWords() {
+  for (size_t i = 0; i < count; i++) {
+    cout << "Word: " << word(i) << endl;
     cout << "Vector: ";
-    for (int j = 0; j < words[i].vec.size(); j++) {
-      cout << words[i].vec[j] << ", ";
+    for (size_t j = 0; j < DIM; j++) {
+      cout << row(i)[j] << ", ";
     }
   }
 }
 
 // For debugging purposes //
-void Words::printWordsRange(int range) {
-  for (int i = 0; i < range; i++) {
-    cout << "Word: " << words[i].word << endl;
+template <size_t DIM>
+void Words<DIM>::printWordsRange(int range) {
+  for (int i = 0; i < range && i < count; i++) {
+    cout << "Word: " << word(i) << endl;
     cout << "Vector: ";
-    for (int j = 0; j < words[i].vec.size(); j++) {
-      cout << words[i].vec[j] << ", ";
+    for (size_t j = 0; j < DIM; j++) {
+      cout << row(i)[j] << ", ";
     }
     cout << endl;
     cout << endl;
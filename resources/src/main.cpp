@@ -3,69 +3,442 @@
 #include "BallTree.h"
 #include "Words.h"
 #include <algorithm>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <sstream>
+#include <sys/resource.h> // getrusage, referenced from https://man7.org/linux/man-pages/man2/getrusage.2.html
 #include "KDTree.h"
+#include "BruteForce.h"
 using namespace std;
 
-int main() {
-    //// BEFORE RUNNING ////
-    // 1) Drop word_list.txt into data folder.
-    // 2) CHANGE word_txt to correct path under your data folder.
+// Peak resident set size of this process so far, in MB.
+double peakMemoryMB() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1e6; // bytes on macOS
+#else
+    return usage.ru_maxrss / 1e3; // kilobytes on Linux
+#endif
+}
+
+// Command line options (see main).
+struct Options {
     string word_txt = "../data/word_list.txt";
+    string snapshot_out = "";
+    int bench_queries = 0;
+    Storage storage = Storage::F32;
+    int recall_queries = 0;
+    int rerank_depth = 0; // Shortlist rescored with fp32 rows under approximate storage (0 = off)
+    bool progressive = false; // Serve brute-force queries while the trees build in the background
+    size_t top = 0; // Load only the first (most frequent) top words of a text file, 0 = all
+    bool brute_engine = false; // Answer interactive searches with the exact scan instead of the trees
+    unsigned threads = 0; // Threads for the exact scan and the ball tree build, 0 = one per core
+    string metric = "cosine"; // cosine, l2 or ip (inner product), see Metrics.h
+    Basis basis = Basis::Original; // Rotate rows so scans can abandon candidates early (variance or pca)
+    BallSplit split = BallSplit::TwoMeans; // How the ball tree divides each ball's points, see BallTree.h
+    size_t sample = 0; // Rows the ball tree fits big nodes' pivots and centers to, 0 = every row (BallTree::setSampling)
+    bool leaf_rows = true; // Copy the ball tree's leaf rows into one contiguous block (BallTree::setLeafRows)
+    string ball_tree_file = ""; // Ball tree index to map instead of building, written after a build if unusable
+};
+
+// Build times of the background trees, for the 'status' command. Each is written before its tree is published.
+struct StartupStatus {
+    long long ball_tree_ms = 0;
+    long long kd_tree_ms = 0;
+};
+
+// Answers a query with the exact scan and prints it like the tree searches do (the word itself comes first).
+// Prints the (id, similarity) results of a search for w, best first.
+template <size_t DIM>
+void printNeighbors(const Words<DIM>& words, const string& w, const vector<pair<int,float>>& res, const string& engine) {
+    cout << "Searching for " << w << "'s nearest semantic neighbors..." << endl;
+    cout << "Top " << res.size() << " semantically closest words to " << w << " (" << engine << "):" << endl;
+    for (size_t i = 0; i < res.size(); i++) {
+        cout << "[" << (i+1) << "] " << words.word(res[i].first) << endl;
+    }
+}
+
+template <size_t DIM, typename Metric>
+void printBruteForce(const Words<DIM>& words, const BruteForceIndex<DIM, Metric>& brute, const string& w, const float *q, int k, const string& engine) {
+    printNeighbors(words, w, brute.knn(q, (size_t)k), engine);
+}
+
+// Prints the depth and leaf sizes of the ball tree, to compare split rules.
+void printBallTreeShape(const BallTreeShape& shape, BallSplit split) {
+    cout << "Ball tree shape (" << splitName(split) << " split): " << shape.leaves << " leaves, depth " << shape.max_depth
+         << ", mean depth of a word " << shape.mean_row_depth << endl;
+    cout << "  Leaf sizes:";
+    for (size_t b = 0; b < shape.leaf_sizes.size(); b++) {
+        if (shape.leaf_sizes[b] > 0) {
+            cout << " " << (1ull << b) << "-" << (2ull << b) - 1 << ": " << shape.leaf_sizes[b] << ";";
+        }
+    }
+    cout << endl;
+}
+
+// Ground truth for recall checks: fp32 query vectors and their exact top-k, taken before the storage changes.
+template <size_t DIM>
+struct RecallSet {
+    vector<array<float, DIM>> queries;
+    vector<vector<pair<int,float>>> truth;
+};
+
+template <size_t DIM, typename Metric>
+RecallSet<DIM> makeRecallSet(const Words<DIM>& words, const BruteForceIndex<DIM, Metric>& brute, int queries, int k) {
+    RecallSet<DIM> set;
+    mt19937 rng(7);
+    uniform_int_distribution<size_t> pick(0, words.size() - 1);
+    set.queries.resize(queries);
+    vector<const float*> qs;
+    for (array<float, DIM>& q : set.queries) {
+        words.decode(pick(rng), q.data());
+        qs.push_back(q.data());
+    }
+    set.truth = brute.knnBatch(qs, k); // One pass over the rows for the whole set
+    return set;
+}
+
+// Prints recall@k of each engine on the current storage against the fp32 ground truth, reranking the best
+// rerank_depth candidates exactly when that is on.
+template <size_t DIM, typename Metric>
+void reportRecall(const Words<DIM>& words, BruteForceIndex<DIM, Metric>& brute, BallTree<DIM, Metric>& ball_tree, KDTree<DIM, Metric>& kd, const RecallSet<DIM>& set, int k, int rerank_depth) {
+    brute.setRerankDepth(rerank_depth);
+    ball_tree.setRerankDepth(rerank_depth);
+    kd.set_rerank_depth(rerank_depth);
+    double brute_recall = 0, ball = 0, kd_recall = 0;
+    vector<pair<int,float>> ball_res(k);
+    for (size_t i = 0; i < set.queries.size(); i++) {
+        const float *q = set.queries[i].data();
+        vector<int> found;
+        for (auto& r : brute.knn(q, k)) found.push_back(r.first);
+        brute_recall += recallAtK(set.truth[i], found);
+
+        found.clear();
+        const size_t n = ball_tree.search(q, k, ball_res.data());
+        for (size_t j = 0; j < n; j++) found.push_back(ball_res[j].first);
+        ball += recallAtK(set.truth[i], found);
+
+        found.clear();
+        for (auto& r : kd.knn(q, k)) found.push_back(r.first);
+        kd_recall += recallAtK(set.truth[i], found);
+    }
+    size_t n = set.queries.size();
+    cout << "Recall@" << k << " (" << Metric::name << ") on " << storageName(words.getStorage()) << " storage vs fp32 brute force (" << n << " queries";
+    if (rerank_depth > k && words.canRerank()) {
+        cout << ", fp32 rerank of top " << rerank_depth;
+    }
+    cout << "):" << endl;
+    cout << "  Brute force: " << brute_recall / n << endl;
+    cout << "  Ball tree:   " << ball / n << endl;
+    cout << "  KD tree:     " << kd_recall / n << endl;
+}
+
+// Runs `queries` searches for random vocabulary words through both trees and the exact scan and prints queries per second.
+template <size_t DIM, typename Metric>
+void benchmarkQueries(const Words<DIM>& words, const BruteForceIndex<DIM, Metric>& brute, const BallTree<DIM, Metric>& ball_tree, const KDTree<DIM, Metric>& kd, int queries, int k) {
+    mt19937 rng(42);
+    uniform_int_distribution<size_t> pick(0, words.size() - 1);
+    vector<size_t> ids(queries);
+    for (size_t& id : ids) {
+        id = pick(rng);
+    }
+
+    // Dimensions summed per candidate by each engine, when the rows are in a basis that allows early abandoning
+    AbandonStats dims[3];
+    words.resetAbandonStats();
+    ball_tree.resetSearchStats();
+
+    auto t1 = chrono::steady_clock::now();
+    size_t found = 0;
+    vector<pair<int,float>> ball_res(k);
+    for (size_t id : ids) {
+        float q[DIM];
+        words.decode(id, q);
+        found += ball_tree.search(q, k, ball_res.data());
+    }
+    auto t2 = chrono::steady_clock::now();
+    dims[0] = words.getAbandonStats();
+    words.resetAbandonStats();
+    for (size_t id : ids) {
+        float q[DIM];
+        words.decode(id, q);
+        found += kd.knn(q, k).size();
+    }
+    auto t3 = chrono::steady_clock::now();
+    dims[1] = words.getAbandonStats();
+    words.resetAbandonStats();
+    for (size_t id : ids) {
+        float q[DIM];
+        words.decode(id, q);
+        found += brute.knn(q, k).size();
+    }
+    auto t4 = chrono::steady_clock::now();
+    dims[2] = words.getAbandonStats();
+    auto dimsNote = [&](const AbandonStats& a) {
+        ostringstream note;
+        if (words.canAbandon()) {
+            note << ", " << a.dimsPerCandidate() << " of " << DIM << " dims per candidate";
+        }
+        return note.str();
+    };
+
+    double ball_s = chrono::duration<double>(t2 - t1).count();
+    double kd_s = chrono::duration<double>(t3 - t2).count();
+    double brute_s = chrono::duration<double>(t4 - t3).count();
+    cout << "Benchmark (" << queries << " queries, k = " << k << ", " << found << " results):" << endl;
+    BallSearchStats ball_stats = ball_tree.getSearchStats();
+    cout << "  Ball tree: " << queries / ball_s << " queries/s (" << 1000 * ball_s / queries << " ms/query" << dimsNote(dims[0]) << ")" << endl;
+    cout << "    " << ball_stats.perQuery() << " distance evaluations per query (" << (double)ball_stats.centers / ball_stats.queries
+         << " ball centers, " << (double)ball_stats.points / ball_stats.queries << " rows)" << endl;
+    cout << "  KD tree:   " << queries / kd_s << " queries/s (" << 1000 * kd_s / queries << " ms/query" << dimsNote(dims[1]) << ")" << endl;
+    cout << "  Brute force (" << brute.getThreads() << " threads): " << queries / brute_s << " queries/s (" << 1000 * brute_s / queries << " ms/query"
+         << dimsNote(dims[2]) << ")" << endl;
+    cout << "  Peak resident memory: " << peakMemoryMB() << " MB" << endl;
+}
 
-    Words words;
+// Average dimensions early abandoning summed per candidate over the session, if it was on.
+template <size_t DIM>
+void printAbandonStats(const Words<DIM>& words) {
+    if (words.canAbandon()) {
+        AbandonStats a = words.getAbandonStats();
+        cout << "Early abandoning: " << a.dimsPerCandidate() << " of " << DIM << " dimensions summed per candidate ("
+             << a.candidates << " candidates)" << endl;
+    }
+}
+
+// Looks w up among the loaded words, then among the words past the load limit, and writes its vector to q.
+// Returns false if w is in neither.
+template <size_t DIM>
+bool lookupQuery(const Words<DIM>& words, const string& w, float *q) {
+    int id = words.findId(w);
+    if (id >= 0) {
+        words.decode(id, q);
+        return true;
+    }
+    return words.fetchTail(w, q);
+}
+
+// Loads the words, builds both trees and runs the interactive search, for DIM-dimensional vectors and the given metric.
+template <size_t DIM, typename Metric>
+int run(const Options& opts) {
+    const string& word_txt = opts.word_txt;
+    const string& snapshot_out = opts.snapshot_out;
+    const int bench_queries = opts.bench_queries;
+    const int recall_k = 10;
+
+    Words<DIM> words;
+    words.setNormalize(Metric::normalized); // L2 and inner product search the vectors as they are in the file
+    cout << "Dot-product kernels: " << kernels::simdLevelName(kernels::simdLevel()) << ", metric: " << Metric::name << endl;
     cout << "Loading words..." << endl;
 
     // chrono usage referenced from https://stackoverflow.com/questions/22387586/measuring-execution-time-of-a-function-in-c.
     auto t1 = chrono::high_resolution_clock::now();
-    words.loadWords(word_txt);
+    words.load(word_txt, opts.top); // GloVe / fastText / word2vec file or a binary snapshot
     auto t2 = chrono::high_resolution_clock::now();
+    cout << endl;
+    words.getLoadStats().print();
 
     auto ms_int = chrono::duration_cast<chrono::milliseconds>(t2 - t1).count();
     auto s_int = chrono::duration_cast<chrono::seconds>(t2 - t1).count();
 
-    cout << "Loaded " << words.getWords().size() << " words!" << endl;
+    cout << "Loaded " << words.size() << " words (" << DIM << "-d)!" << endl;
+    if (!words.isMapped()) { // For a snapshot this would page in the whole matrix just to count
+        cout << "Zero vectors (left unnormalized, cosine 0 with every query): " << words.zeroVectors().size() << endl;
+    }
+    if (words.hasTail()) {
+        cout << "Only the top " << words.size() << " words are indexed; rarer words are read from the file when queried." << endl;
+    }
     cout << "Execution time: " << ms_int << " milliseconds. (" << s_int << " seconds)" << endl;
+    cout << "Vector storage: " << words.memoryBytes() / 1e6 << " MB" << (words.isMapped() ? " (mapped)" : "") << endl;
 
-    // Construct Ball Tree
-    cout << "Constructing ball tree..." << endl;
-    BallTree ball_tree;
+    // One-off conversion: write the normalized vocabulary so later runs can skip parsing.
+    if (snapshot_out != "") {
+        if (!words.saveSnapshot(snapshot_out)) {
+            return 1;
+        }
+        cout << "Snapshot written to " << snapshot_out << endl;
+        return 0;
+    }
 
-    auto t3 = chrono::high_resolution_clock::now();
-    ball_tree.constructBalltree(words.getWords(), words);
-    auto t4 = chrono::high_resolution_clock::now();
+    // Rotate before anything reads the rows, so the recall queries and the trees see the same coordinates.
+    if (opts.basis != Basis::Original) {
+        auto t_basis = chrono::steady_clock::now();
+        if (!words.setBasis(opts.basis)) {
+            return 1;
+        }
+        cout << "Rows rotated onto the " << basisName(opts.basis) << " basis in "
+             << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - t_basis).count()
+             << " ms; scans abandon candidates every " << ABANDON_STEP << " dimensions" << endl;
+    }
 
-    auto ms_int_2 = chrono::duration_cast<chrono::milliseconds>(t4 - t3).count();
-    auto s_int_2 = chrono::duration_cast<chrono::seconds>(t4 - t3).count();
+    // The exact scan: ground truth for recall, fallback while the trees build, and an engine of its own (--engine brute).
+    BruteForceIndex<DIM, Metric> brute(words, opts.threads > 0 ? opts.threads : defaultThreadCount());
 
-    cout << "Ball tree constructed!" << endl;
-    cout << "Execution time: " << ms_int_2 << " milliseconds. (" << s_int_2 << " seconds)" << endl;
+    // Ground truth has to come from the fp32 rows, before they are converted.
+    RecallSet<DIM> recall_set;
+    if (opts.recall_queries > 0) {
+        recall_set = makeRecallSet(words, brute, opts.recall_queries, recall_k);
+    }
+    if (opts.storage != Storage::F32) {
+        if (!words.setStorage(opts.storage)) {
+            return 1;
+        }
+        cout << "Vector storage: " << words.memoryBytes() / 1e6 << " MB as " << storageName(opts.storage) << endl;
+        if (words.canRerank()) {
+            cout << "fp32 rows kept for reranking: " << words.size() * DIM * sizeof(float) / 1e6 << " MB"
+                 << (words.isMapped() ? " (mapped, read per shortlist)" : " (resident, included above)") << endl;
+        }
+    }
+    brute.setRerankDepth(opts.rerank_depth);
 
-    cout << "Constructing KD tree..." << endl;
-    KDTree kd(words.getWords(), 128);
+    // With --engine brute and nothing to compare against, the trees are never needed.
+    if (opts.brute_engine && bench_queries == 0 && opts.recall_queries == 0) {
+        cout << "Searching with the exact brute-force scan (" << brute.getThreads() << " threads)." << endl;
+        while (true) {
+            cout << "Enter new word to generate semantic neighbor list (type '0' to exit program): ";
+            string w;
+            if (!(cin >> w) || w == "0") {
+                break;
+            }
+            float q[DIM];
+            if (!lookupQuery(words, w, q)) {
+                cout << "Please enter a valid word..." << endl;
+                continue;
+            }
+            cout << "Enter number of neighbors to search: ";
+            int k;
+            if (!(cin >> k) || k <= 0) {
+                cout << "Invalid k." << endl;
+                continue;
+            }
+            auto t5 = chrono::high_resolution_clock::now();
+            printBruteForce(words, brute, w, q, k, "brute force");
+            auto t6 = chrono::high_resolution_clock::now();
+            cout << endl;
+            cout << "Execution time: " << chrono::duration_cast<chrono::milliseconds>(t6 - t5).count() << " milliseconds" << endl;
+            cout << endl;
+        }
+        words.getLookupStats().print();
+        printAbandonStats(words);
+        return 0;
+    }
 
-    auto t7 = chrono::high_resolution_clock::now();
-    kd.build();
-    auto t8 = chrono::high_resolution_clock::now();
+    // Build the trees. With --progressive this happens on background threads and each tree is published through
+    // an atomic pointer once it is complete; until then the interactive search answers with an exact brute-force
+    // scan, so the first query only waits for the load. Atomics referenced from https://en.cppreference.com/w/cpp/atomic/atomic
+    const bool progressive = opts.progressive && bench_queries == 0 && opts.recall_queries == 0;
+    StartupStatus status;
+    unique_ptr<BallTree<DIM, Metric>> ball_tree_owner;
+    unique_ptr<KDTree<DIM, Metric>> kd_owner;
+    atomic<BallTree<DIM, Metric>*> ball_tree_ready{nullptr};
+    atomic<KDTree<DIM, Metric>*> kd_ready{nullptr};
 
-    auto ms_int_4 = chrono::duration_cast<chrono::milliseconds>(t8 - t7).count();
-    auto s_int_4 = chrono::duration_cast<chrono::seconds>(t8 - t7).count();
+    auto buildBallTree = [&]() {
+        if (!progressive) cout << "Constructing ball tree..." << endl;
+        auto t3 = chrono::high_resolution_clock::now();
+        ball_tree_owner = make_unique<BallTree<DIM, Metric>>();
+        ball_tree_owner->setSplit(opts.split);
+        ball_tree_owner->setSampling(opts.sample);
+        ball_tree_owner->setLeafRows(opts.leaf_rows);
+        // A saved tree is only used if it was built on these exact rows with these settings (the checks are in
+        // loadIndex); otherwise it is built again and the file rewritten.
+        const bool loaded = opts.ball_tree_file != "" && ifstream(opts.ball_tree_file).good()
+                            && ball_tree_owner->loadIndex(opts.ball_tree_file, words);
+        if (!loaded) {
+            ball_tree_owner->constructBalltree(words, opts.threads > 0 ? opts.threads : defaultThreadCount());
+        }
+        ball_tree_owner->setRerankDepth(opts.rerank_depth);
+        auto t4 = chrono::high_resolution_clock::now();
+        status.ball_tree_ms = chrono::duration_cast<chrono::milliseconds>(t4 - t3).count();
+        ball_tree_ready.store(ball_tree_owner.get(), memory_order_release);
 
-    cout << "KD tree constructed!" << endl;
-    cout << "Execution time: " << ms_int_4 << " milliseconds. (" << s_int_4 << " seconds)" << endl;
+        if (!progressive) {
+            cout << (loaded ? "Ball tree loaded from " + opts.ball_tree_file : string("Ball tree constructed!")) << endl;
+            cout << "Execution time: " << status.ball_tree_ms << " milliseconds. (" << status.ball_tree_ms / 1000 << " seconds)" << endl;
+            // The ball tree is the first thing built after loading, so the peak so far covers its construction.
+            cout << "Ball tree memory: " << ball_tree_owner->memoryBytes() / 1e6 << " MB" << (ball_tree_owner->isMapped() ? " mapped" : "")
+                 << " (peak resident memory so far: " << peakMemoryMB() << " MB)" << endl;
+            printBallTreeShape(ball_tree_owner->shape(), ball_tree_owner->getSplit());
+        }
+        if (!loaded && opts.ball_tree_file != "" && ball_tree_owner->saveIndex(opts.ball_tree_file) && !progressive) {
+            cout << "Ball tree written to " << opts.ball_tree_file << endl;
+        }
+    };
+    auto buildKDTree = [&]() {
+        if (!progressive) cout << "Constructing KD tree..." << endl;
+        auto t7 = chrono::high_resolution_clock::now();
+        kd_owner = make_unique<KDTree<DIM, Metric>>(words, 128);
+        kd_owner->build();
+        kd_owner->set_rerank_depth(opts.rerank_depth);
+        auto t8 = chrono::high_resolution_clock::now();
+        status.kd_tree_ms = chrono::duration_cast<chrono::milliseconds>(t8 - t7).count();
+        kd_ready.store(kd_owner.get(), memory_order_release);
+
+        if (!progressive) {
+            cout << "KD tree constructed!" << endl;
+            cout << "Execution time: " << status.kd_tree_ms << " milliseconds. (" << status.kd_tree_ms / 1000 << " seconds)" << endl;
+        }
+    };
+
+    thread ball_tree_builder, kd_builder;
+    if (progressive) {
+        ball_tree_builder = thread(buildBallTree);
+        kd_builder = thread(buildKDTree);
+        cout << "Trees are building in the background; searches use brute force until they are ready (type 'status' to check)." << endl;
+    }
+    else {
+        buildBallTree();
+        buildKDTree();
+    }
+
+    if (!progressive) {
+        BallTree<DIM, Metric>& ball_tree = *ball_tree_owner;
+        KDTree<DIM, Metric>& kd = *kd_owner;
+        if (opts.recall_queries > 0) {
+            reportRecall(words, brute, ball_tree, kd, recall_set, recall_k, 0);
+            if (opts.rerank_depth > recall_k && words.canRerank()) {
+                reportRecall(words, brute, ball_tree, kd, recall_set, recall_k, opts.rerank_depth);
+            }
+        }
+        brute.setRerankDepth(opts.rerank_depth);
+        ball_tree.setRerankDepth(opts.rerank_depth);
+        kd.set_rerank_depth(opts.rerank_depth);
+        if (bench_queries > 0) {
+            benchmarkQueries(words, brute, ball_tree, kd, bench_queries, 10);
+        }
+        if (bench_queries > 0 || opts.recall_queries > 0) {
+            return 0;
+        }
+    }
+    auto printStatus = [&]() {
+        BallTree<DIM, Metric> *ball_tree = ball_tree_ready.load(memory_order_acquire);
+        KDTree<DIM, Metric> *kd = kd_ready.load(memory_order_acquire);
+        cout << "Status: brute force ready (" << words.size() << " words)";
+        cout << "; ball tree " << (ball_tree ? "ready (built in " + to_string(status.ball_tree_ms) + " ms)" : "building");
+        cout << "; KD tree " << (kd ? "ready (built in " + to_string(status.kd_tree_ms) + " ms)" : "building") << endl;
+        words.getLookupStats().print();
+    };
 
     // Semantic knn search input
     string w = "";
     string neighbors = "";
     while (true) {
         cout << "Enter new word to generate semantic neighbor list (type '0' to exit into K-D Tree): ";
-        cin >> w;
-        if (w == "0") {
+        if (!(cin >> w) || w == "0") {
             break;
         }
+        if (w == "status") {
+            printStatus();
+            continue;
+        }
 
-        // Find w's WordVector
-        WordVector t = words.findWord(w);
-        if (t.getWord() == "") {
+        // Find w's vector, among the indexed words or in the tail of the file
+        float q[DIM];
+        if (!lookupQuery(words, w, q)) {
+            cout << "Error: Word not found" << endl;
             cout << "Please enter a valid word..." << endl;
             continue;
         }
@@ -75,7 +448,18 @@ int main() {
         int k = stoi(neighbors);
 
         auto t5 = chrono::high_resolution_clock::now();
-        ball_tree.knn_search(t, k);
+        BallTree<DIM, Metric> *ball_tree = ball_tree_ready.load(memory_order_acquire);
+        if (k <= 0) {
+            cout << "Error: knn search must be non-negative." << endl;
+        }
+        else if (ball_tree) {
+            vector<pair<int,float>> res(k);
+            res.resize(ball_tree->search(q, k, res.data()));
+            printNeighbors(words, w, res, "Ball Tree implementation");
+        }
+        else {
+            printBruteForce(words, brute, w, q, k, "brute force, ball tree still building");
+        }
         auto t6 = chrono::high_resolution_clock::now();
 
         auto ms_int_3 = chrono::duration_cast<chrono::milliseconds>(t6 - t5).count();
@@ -89,39 +473,158 @@ int main() {
     while(true) {
         cout << "Enter new word to generate semantic neighbor list (type '0' to exit program): ";
         string w; if(!(cin >> w) || w == "0") break;
+        if(w == "status") { printStatus(); continue; }
 
         cout << "Enter number of neighbors to search: ";
         int k; if(!(cin >> k) || k <= 0) {
             cout << "Invalid k.\n"; continue;
         }
 
-        //find the word in the word list
-        const auto& D = words.getWords();
-        int qi = -1;
-        for(int i = 0; i < (int)D.size(); ++i) {
-            if(D[i].word == w) {
-                qi = i; break;
-            }
-        }
-        if(qi < 0) {
+        //find the word in the word list (O(1) hash lookup), or in the tail of the file
+        float q[DIM];
+        if(!lookupQuery(words, w, q)) {
             cout << "Please enter a valid word...\n"; continue;
         }
 
         auto t9 = chrono::high_resolution_clock::now();
-        auto res = kd.knn(D[qi].vec, (size_t)k);
+        KDTree<DIM, Metric> *kd = kd_ready.load(memory_order_acquire);
+        if(!kd) {
+            printBruteForce(words, brute, w, q, k, "brute force, K-D Tree still building");
+        }
+        else {
+            auto res = kd->knn(q, (size_t)k);
+
+            sort(res.begin(), res.end(), [](auto& a, auto& b){ return a.second > b.second; });
+            cout << "Searching for " << w << "'s nearest semantic neighbors..." << endl;
+            cout << "Top " << res.size() << " semantically closest words to " << w << " (K-D Tree implementation):\n";
+            for(size_t i = 0; i < res.size(); ++i) {
+                cout << "[" << (i+1) << "] " << words.word(res[i].first) << "\n";
+            }
+        }
         auto t10 = chrono::high_resolution_clock::now();
 
         auto ms_int_5 = chrono::duration_cast<chrono::milliseconds>(t10 - t9).count();
 
-        sort(res.begin(), res.end(), [](auto& a, auto& b){ return a.second > b.second; });
-        cout << "Searching for " << w << "'s nearest semantic neighbors..." << endl;
-        cout << "Top " << res.size() << " semantically closest words to " << w << " (K-D Tree implementation):\n";
-        for(size_t i = 0; i < res.size(); ++i) {
-            cout << "[" << (i+1) << "] " << D[res[i].first].word << "\n";
-        }
         cout << endl;
         cout << "Execution time: " << ms_int_5 << " milliseconds" << endl;
         cout << endl;
     }
+
+    words.getLookupStats().print();
+    printAbandonStats(words);
+
+    // The builders use words, so let them finish before it goes out of scope.
+    for (thread* b : {&ball_tree_builder, &kd_builder}) {
+        if (b->joinable()) {
+            b->join();
+        }
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+// Picks the instantiation for the metric given on the command line.
+template <size_t DIM>
+int runWithMetric(const Options& opts) {
+    if (opts.metric == "l2") {
+        return run<DIM, L2Metric>(opts);
+    }
+    if (opts.metric == "ip") {
+        return run<DIM, InnerProductMetric>(opts);
+    }
+    return run<DIM, CosineMetric>(opts);
+}
+
+int main(int argc, char* argv[]) {
+    //// BEFORE RUNNING ////
+    // 1) Drop word_list.txt into data folder.
+    // 2) CHANGE word_txt to correct path under your data folder (or pass the path as the first argument).
+    // Usage: semantic [word_list.txt | snapshot.bin] [--save-snapshot out.bin] [--bench queries]
+    //                 [--storage fp32|fp16|bf16|int8|int8-dim] [--rerank depth] [--recall queries] [--progressive]
+    //                 [--top words] [--engine trees|brute] [--threads n] [--metric cosine|l2|ip]
+    //                 [--basis file|variance|pca] [--split pivots|2means|pca] [--sample rows] [--ball-tree tree.bin]
+    //                 [--no-leaf-rows]
+    Options opts;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--save-snapshot" && i + 1 < argc) {
+            opts.snapshot_out = argv[++i];
+        }
+        else if (arg == "--bench" && i + 1 < argc) {
+            opts.bench_queries = stoi(argv[++i]);
+        }
+        else if (arg == "--storage" && i + 1 < argc) {
+            if (!parseStorage(argv[++i], opts.storage)) {
+                cerr << "Error: unknown storage " << argv[i] << " (use fp32, fp16, bf16, int8 or int8-dim)" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--recall" && i + 1 < argc) {
+            opts.recall_queries = stoi(argv[++i]);
+        }
+        else if (arg == "--rerank" && i + 1 < argc) {
+            opts.rerank_depth = stoi(argv[++i]);
+        }
+        else if (arg == "--progressive") {
+            opts.progressive = true;
+        }
+        else if (arg == "--top" && i + 1 < argc) {
+            opts.top = stoul(argv[++i]);
+        }
+        else if (arg == "--engine" && i + 1 < argc) {
+            string engine = argv[++i];
+            if (engine != "trees" && engine != "brute") {
+                cerr << "Error: unknown engine " << engine << " (use trees or brute)" << endl;
+                return 1;
+            }
+            opts.brute_engine = engine == "brute";
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            opts.threads = stoul(argv[++i]);
+        }
+        else if (arg == "--basis" && i + 1 < argc) {
+            if (!parseBasis(argv[++i], opts.basis)) {
+                cerr << "Error: unknown basis " << argv[i] << " (use file, variance or pca)" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--split" && i + 1 < argc) {
+            if (!parseSplit(argv[++i], opts.split)) {
+                cerr << "Error: unknown split " << argv[i] << " (use pivots, 2means or pca)" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--no-leaf-rows") {
+            opts.leaf_rows = false;
+        }
+        else if (arg == "--ball-tree" && i + 1 < argc) {
+            opts.ball_tree_file = argv[++i];
+        }
+        else if (arg == "--sample" && i + 1 < argc) {
+            opts.sample = stoul(argv[++i]);
+        }
+        else if (arg == "--metric" && i + 1 < argc) {
+            opts.metric = argv[++i];
+            if (opts.metric != "cosine" && opts.metric != "l2" && opts.metric != "ip") {
+                cerr << "Error: unknown metric " << opts.metric << " (use cosine, l2 or ip)" << endl;
+                return 1;
+            }
+        }
+        else {
+            opts.word_txt = arg;
+        }
+    }
+
+    // The dimension is a template parameter everywhere, so pick the instantiation that matches the file.
+    size_t dim = detectDimension(opts.word_txt);
+    switch (dim) {
+        case 25: return runWithMetric<25>(opts);
+        case 50: return runWithMetric<50>(opts);
+        case 100: return runWithMetric<100>(opts);
+        case 200: return runWithMetric<200>(opts);
+        case 300: return runWithMetric<300>(opts);
+        default:
+            cerr << "Error: unsupported vector dimension " << dim << " in " << opts.word_txt
+                 << " (supported: 25, 50, 100, 200, 300)" << endl;
+            return 1;
+    }
+}